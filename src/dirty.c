@@ -0,0 +1,161 @@
+#include "dirty.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#define DIRTY_MAGIC "FAT32CKP"
+#define DIRTY_VERSION 1
+
+typedef struct {
+    uint8_t magic[8];
+    uint32_t version;
+    uint32_t units;
+} __attribute__((packed)) dirty_header_t;
+
+struct dirty_map {
+    FILE *file;
+    uint32_t units;
+    uint8_t *bits;
+    size_t bytes;
+    // byte range changed since the last save, empty when changed_start >= changed_end
+    size_t changed_start;
+    size_t changed_end;
+};
+
+static int write_all(dirty_map_t *map) {
+    dirty_header_t header = {0};
+    memcpy(header.magic, DIRTY_MAGIC, 8);
+    header.version = htole32(DIRTY_VERSION);
+    header.units = htole32(map->units);
+
+    if (fseek(map->file, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, map->file) != 1 ||
+        fwrite(map->bits, map->bytes, 1, map->file) != 1 || fflush(map->file))
+        return -1;
+
+    map->changed_start = map->changed_end = 0;
+    return 0;
+}
+
+dirty_map_t *dirty_map_open(const char *path, uint32_t units, int reset) {
+    dirty_map_t *map = calloc(1, sizeof(dirty_map_t));
+    if (!map) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return NULL;
+    }
+
+    map->units = units;
+    map->bytes = (units + 7) / 8;
+    map->bits = calloc(map->bytes, 1);
+    if (!map->bits) {
+        fprintf(stderr, "failed to allocate memory\n");
+        free(map);
+        return NULL;
+    }
+
+    map->file = reset ? NULL : fopen(path, "r+b");
+    if (map->file) {
+        dirty_header_t header;
+        if (fread(&header, sizeof(header), 1, map->file) != 1 ||
+            memcmp(header.magic, DIRTY_MAGIC, 8) != 0 ||
+            le32toh(header.version) != DIRTY_VERSION || le32toh(header.units) != units ||
+            fread(map->bits, map->bytes, 1, map->file) != 1) {
+            fprintf(stderr, "%s is not a checkpoint of this image\n", path);
+            dirty_map_close(map);
+            return NULL;
+        }
+        return map;
+    }
+
+    map->file = fopen(path, "w+b");
+    if (!map->file || write_all(map)) {
+        fprintf(stderr, "failed to create checkpoint %s\n", path);
+        dirty_map_close(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+void dirty_map_close(dirty_map_t *map) {
+    if (!map)
+        return;
+
+    if (map->file)
+        fclose(map->file);
+    free(map->bits);
+    free(map);
+}
+
+void dirty_map_mark(dirty_map_t *map, uint32_t first, uint32_t count) {
+    if (first >= map->units)
+        return;
+    if (count > map->units - first)
+        count = map->units - first;
+    if (count == 0)
+        return;
+
+    uint32_t end = first + count;
+    for (uint32_t unit = first; unit < end; unit++)
+        map->bits[unit / 8] |= 1 << (unit % 8);
+
+    size_t start_byte = first / 8;
+    size_t end_byte = (end - 1) / 8 + 1;
+    if (map->changed_start >= map->changed_end) {
+        map->changed_start = start_byte;
+        map->changed_end = end_byte;
+    } else {
+        if (start_byte < map->changed_start)
+            map->changed_start = start_byte;
+        if (end_byte > map->changed_end)
+            map->changed_end = end_byte;
+    }
+}
+
+void dirty_map_clear(dirty_map_t *map) {
+    memset(map->bits, 0, map->bytes);
+    map->changed_start = 0;
+    map->changed_end = map->bytes;
+}
+
+int dirty_map_save(dirty_map_t *map) {
+    if (map->changed_start >= map->changed_end)
+        return 0;
+
+    long offset = sizeof(dirty_header_t) + map->changed_start;
+    size_t len = map->changed_end - map->changed_start;
+    if (fseek(map->file, offset, SEEK_SET) ||
+        fwrite(map->bits + map->changed_start, len, 1, map->file) != 1 || fflush(map->file)) {
+        fprintf(stderr, "failed to save checkpoint\n");
+        return -1;
+    }
+
+    map->changed_start = map->changed_end = 0;
+    return 0;
+}
+
+int dirty_map_next_run(dirty_map_t *map, uint32_t *unit, uint32_t *count) {
+    uint32_t pos = *unit;
+
+    while (pos < map->units) {
+        // skip clean bytes whole
+        if ((pos % 8) == 0 && map->bits[pos / 8] == 0) {
+            pos += 8;
+            continue;
+        }
+        if (map->bits[pos / 8] & (1 << (pos % 8)))
+            break;
+        pos++;
+    }
+    if (pos >= map->units)
+        return 0;
+
+    uint32_t end = pos;
+    while (end < map->units && (map->bits[end / 8] & (1 << (end % 8))))
+        end++;
+
+    *unit = pos;
+    *count = end - pos;
+    return 1;
+}
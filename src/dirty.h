@@ -0,0 +1,21 @@
+#ifndef FAT32_DIRTY_H
+#define FAT32_DIRTY_H
+
+#include <stdint.h>
+
+// persistent bitmap of units changed since it was last reset, kept in its own file
+typedef struct dirty_map dirty_map_t;
+
+// opens the map at path, creating it empty if it does not exist or if reset is set
+dirty_map_t *dirty_map_open(const char *path, uint32_t units, int reset);
+void dirty_map_close(dirty_map_t *map);
+
+void dirty_map_mark(dirty_map_t *map, uint32_t first, uint32_t count);
+void dirty_map_clear(dirty_map_t *map);
+// writes out the part of the bitmap changed since the last save
+int dirty_map_save(dirty_map_t *map);
+
+// finds the first run of marked units at or after *unit, returns 0 if there is none
+int dirty_map_next_run(dirty_map_t *map, uint32_t *unit, uint32_t *count);
+
+#endif
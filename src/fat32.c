@@ -1,4 +1,11 @@
+#define _GNU_SOURCE
+
 #include "fat32.h"
+#include "overlay.h"
+#include "dirty.h"
+#include "pool.h"
+#include "trace.h"
+#include "vfat.h"
 
 #include <stdio.h>
 #include <endian.h>
@@ -7,8 +14,14 @@
 #include <stdint.h>
 #include <ctype.h>
 #include <time.h>
-#include <libgen.h>
-
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/file.h>
+
+// geometry of the images create_fat32_file makes, mounted images use what their BPB says
 #define FILE_SIZE (20 * 1024 * 1024)
 
 #define SECTOR_SIZE 512
@@ -223,637 +236,3650 @@ int create_fat32_file(const char *filepath) {
     return 0;
 }
 
-static uint32_t read_fat_entry(FILE *file, uint32_t cluster, uint32_t fat_start_sector) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fat_start_sector + (fat_offset / SECTOR_SIZE);
-    uint32_t fat_entry_offset = fat_offset % SECTOR_SIZE;
+#define ARENA_CLUSTERS 4
+
+#define COMPACT_TOMBSTONE_PERCENT 50
+#define COMPACT_MIN_TOMBSTONES 16
+
+#define DEFRAG_BATCH_CLUSTERS 256
+#define FLATTEN_CHUNK_SIZE (1024 * 1024)
+#define FLATTEN_HOLE_SIZE 4096
+
+#define RM_FILE 0
+#define RM_DIR 1
+#define RM_RECURSIVE 2
+#define END_OF_CHAIN 0x0FFFFFF8
+#define FAT_BLOCK_SECTORS 8
+#define FAT_BLOCK_SHIFT 3
+#define MIN_SECTOR_SIZE 512
+#define MAX_SECTOR_SIZE 4096
+#define MAX_CLUSTER_SIZE (64 * 1024)
+#define EXT_FLAGS_NO_MIRROR 0x0080
+#define EXT_FLAGS_ACTIVE_FAT 0x000F
+#define FS_INFO_UNKNOWN 0xFFFFFFFF
+// set in FAT[1] while the volume is not mounted
+#define FAT_CLEAN_SHUTDOWN 0x08000000
+
+#define MAX_CHECKPOINTS 8
+#define CHECKPOINT_NAME_MAX 32
+#define CHECKPOINT_SUFFIX ".ckpt"
+#define DIFF_MAGIC "FAT32DIF"
+#define DIFF_VERSION 1
+#define DIFF_CHUNK_SIZE (1024 * 1024)
+#define WALK_RUN_CLUSTERS 16
+#define DIR_INDEX_COUNT 8
+#define DIR_INDEX_MIN_CAPACITY 64
+#define WALK_PATH_MAX 4096
 
-    fseek(file, fat_sector * SECTOR_SIZE + fat_entry_offset, SEEK_SET);
-    uint32_t fat_entry;
-    fread(&fat_entry, sizeof(fat_entry), 1, file);
-    return le32toh(fat_entry) & 0x0FFFFFFF;
-}
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+} arena_t;
 
-static void write_fat_entry(FILE *file,
-                            uint32_t cluster,
-                            uint32_t value,
-                            uint32_t fat_start_sector,
-                            uint8_t num_fats) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector_offset = fat_offset / SECTOR_SIZE;
-    uint32_t fat_entry_offset = fat_offset % SECTOR_SIZE;
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} cluster_run_t;
 
-    value = htole32(value & 0x0FFFFFFF);
+// tracks what changed since the checkpoint was taken. Units are the reserved and FAT sectors
+// followed by the data clusters
+typedef struct {
+    char name[CHECKPOINT_NAME_MAX + 1];
+    dirty_map_t *map;
+} checkpoint_t;
 
-    for (int i = 0; i < num_fats; i++) {
-        uint32_t fat_sector =
-            fat_start_sector + (i * (fat_start_sector / num_fats)) + fat_sector_offset;
-        fseek(file, fat_sector * SECTOR_SIZE + fat_entry_offset, SEEK_SET);
-        fwrite(&value, sizeof(value), 1, file);
-    }
-}
+typedef struct {
+    uint8_t magic[8];
+    uint32_t version;
+    uint64_t image_size;
+    uint32_t record_count;
+} __attribute__((packed)) diff_header_t;
 
-static uint32_t find_free_cluster(FILE *file, uint32_t fat_start_sector, uint32_t cluster_count) {
-    for (uint32_t cluster = 2; cluster < cluster_count + 2; cluster++) {
-        if (read_fat_entry(file, cluster, fat_start_sector) == 0) {
-            return cluster;
-        }
-    }
-    return 0;
-}
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+} __attribute__((packed)) diff_record_t;
+
+// the FAT is kept in memory, loaded in blocks on first use and written back in contiguous runs of
+// dirty sectors at the end of each operation, and ahead of any directory entry write
+typedef struct {
+    uint32_t *entries;
+    uint8_t *loaded;
+    uint8_t *dirty;
+    // dirty sectors lie between dirty_first and dirty_last, so write backs only look there
+    uint32_t dirty_first;
+    uint32_t dirty_last;
+    uint32_t dirty_count;
+    uint32_t sectors;
+    // first sector of the FAT that is read and written on the hot path
+    uint32_t active_start;
+    // sectors written to the active FAT but not yet to its mirrors, which only happens at full
+    // syncs. stale is NULL when the volume has no mirrors to keep
+    uint8_t *stale;
+    uint32_t stale_first;
+    uint32_t stale_last;
+    uint32_t stale_count;
+    // entries in one copy of the FAT
+    uint32_t entry_count;
+    // cluster number to sector and to block of the cache
+    uint8_t sector_shift;
+    uint8_t block_shift;
+} fat_cache_t;
+
+// points a name hash at the span of entries holding the name. checksum is that of the span's short
+// entry, so records left behind by removed entries are told apart without reading the long name
+typedef struct {
+    uint32_t hash;
+    uint32_t cluster;
+    uint16_t index;
+    // 0 for an unused record
+    uint8_t count;
+    uint8_t checksum;
+} name_record_t;
+
+// open addressed hash index over every name of a directory, long and short. Built by the first
+// lookup in the directory, kept up to date by inserts and dropped when entries move
+typedef struct {
+    // 0 when unused
+    uint32_t dir_cluster;
+    uint32_t used;
+    uint32_t capacity;
+    uint64_t last_use;
+    name_record_t *records;
+    // raw entries ahead of the end marker, in use and removed, so removals can tell when the
+    // directory is worth compacting without scanning it
+    uint32_t live;
+    uint32_t tombstones;
+} dir_index_t;
+
+struct fat32_volume {
+    // the image, or NULL when every access goes through an overlay
+    FILE *file;
+    overlay_t *overlay;
+    fat32_bpb_t bpb;
+    fat32_fs_info_t fs_info;
+    int fs_info_valid;
+    int fs_info_dirty;
+    fat_cache_t fat;
+    // a bit per cluster, set while it is free. Built on the first allocation, or at mount when
+    // the last session did not shut down cleanly
+    uint64_t *free_map;
+    // records every call while set
+    trace_t *trace;
+    // validated at mount, every offset is computed with these shifts and masks
+    uint32_t sector_size;
+    uint8_t sector_shift;
+    uint8_t sec_per_clus_shift;
+    uint8_t cluster_shift;
+    uint32_t cluster_mask;
+    uint32_t entries_per_cluster;
+    uint32_t fat_start;
+    uint32_t fat_size;
+    uint32_t data_start;
+    off_t data_offset;
+    uint32_t cluster_size;
+    uint32_t total_clusters;
+    uint32_t root_cluster;
+    arena_t arena;
+    fat32_dir_t *spare_dir;
+    uint32_t *dir_stack;
+    size_t dir_stack_capacity;
+    int alloc_policy;
+    // runs freed by the current operation, handed back to the host at volume_sync
+    cluster_run_t *punch_runs;
+    size_t punch_count;
+    size_t punch_capacity;
+    int punch_disabled;
+    // the image, or the delta of an overlay, checkpoint files are named after it
+    char path[PATH_MAX];
+    checkpoint_t checkpoints[MAX_CHECKPOINTS];
+    int checkpoint_count;
+    int batch_depth;
+    dir_index_t indexes[DIR_INDEX_COUNT];
+    uint64_t index_clock;
+    // alias tails seen while inserting a long name, grows only
+    uint8_t *used_tails;
+    size_t used_tails_size;
+};
+
+struct fat32_dir {
+    fat32_volume_t *vol;
+    uint32_t cluster;
+    uint32_t index;
+    int loaded;
+    int finished;
+    vfat_lfn_t lfn;
+    // a listing is traced from opendir to closedir
+    char *trace_path;
+    uint64_t trace_start;
+    uint32_t entries;
+    uint8_t buf[];
+};
 
-static void name_to_83(const char *name, uint8_t *dest) {
-    memset(dest, ' ', 11);
+typedef struct {
+    uint32_t cluster;
+    uint32_t index;
+} dir_slot_t;
 
-    int name_len = strlen(name);
-    int dot_pos = -1;
+// a name being looked up, in the form names are matched and indexed in
+typedef struct {
+    uint16_t chars[VFAT_NAME_MAX];
+    uint32_t len;
+    uint32_t hash;
+} name_key_t;
 
-    for (int i = name_len - 1; i >= 0; i--) {
-        if (name[i] == '.') {
-            dot_pos = i;
-            break;
-        }
-    }
+// the entries holding one name, its long name entries if any followed by the short entry
+typedef struct {
+    dir_slot_t first;
+    uint32_t count;
+    vfat_lfn_t lfn;
+} dir_span_t;
 
-    int name_part_len = (dot_pos == -1) ? name_len : dot_pos;
-    for (int i = 0; i < name_part_len && i < 8; i++) {
-        dest[i] = toupper(name[i]);
-    }
+// short names a new entry may take, checked in the same pass that looks for room for it
+typedef struct {
+    // what ~N tails are added to
+    const uint8_t *basis;
+    // taken as is unless another entry has it
+    const uint8_t *preferred;
+    int preferred_taken;
+    // lowest tail no short name of the basis uses
+    uint32_t tail;
+} alias_probe_t;
 
-    if (dot_pos != -1) {
-        int ext_len = name_len - dot_pos - 1;
-        for (int i = 0; i < ext_len && i < 3; i++) {
-            dest[8 + i] = toupper(name[dot_pos + 1 + i]);
-        }
+typedef struct {
+    const char *pos;
+    const char *end;
+} path_iter_t;
+
+static void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (arena->used + size > arena->size) {
+        fprintf(stderr, "operation arena exhausted\n");
+        return NULL;
     }
+
+    void *ptr = arena->base + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+static void arena_reset(arena_t *arena) {
+    arena->used = 0;
 }
 
-static uint32_t find_dir_entry_cluster(FILE *file,
-                                       uint32_t start_cluster,
-                                       const char *name,
-                                       fat32_bpb_t *bpb,
-                                       uint32_t data_start_sector,
-                                       uint32_t fat_start_sector) {
-    uint8_t target_name[11];
-    name_to_83(name, target_name);
+static int is_separator(char c) {
+    return c == '/' || c == '\\';
+}
 
-    uint32_t cluster = start_cluster;
-    uint32_t cluster_size = le16toh(bpb->byts_per_sec) * bpb->sec_per_clus;
+static void path_iter_init(path_iter_t *it, const char *path, size_t len) {
+    it->pos = path;
+    it->end = path + len;
+}
 
-    while (cluster < 0x0FFFFFF8) {
-        uint32_t sector = data_start_sector + (cluster - 2) * bpb->sec_per_clus;
-        fseek(file, sector * SECTOR_SIZE, SEEK_SET);
+// yields the next component of the path as a span into the caller's buffer
+static int path_iter_next(path_iter_t *it, const char **name, size_t *name_len) {
+    while (it->pos < it->end && is_separator(*it->pos))
+        it->pos++;
+    if (it->pos == it->end)
+        return 0;
 
-        fat32_dir_entry_t entry;
-        for (int i = 0; i < cluster_size / sizeof(fat32_dir_entry_t); i++) {
-            fread(&entry, sizeof(entry), 1, file);
+    const char *start = it->pos;
+    while (it->pos < it->end && !is_separator(*it->pos))
+        it->pos++;
 
-            if (entry.name[0] == 0)
-                return 0;
-            if (entry.name[0] == 0xE5)
-                continue;
+    *name = start;
+    *name_len = it->pos - start;
+    return 1;
+}
 
-            if (memcmp(entry.name, target_name, 11) == 0 && (entry.attr & ATTR_DIRECTORY)) {
-                return (le16toh(entry.fst_clus_hi) << 16) | le16toh(entry.fst_clus_lo);
-            }
-        }
+// splits path into the length of its parent part and its last component, returns 0 for root
+static int path_split(const char *path, size_t *parent_len, const char **name, size_t *name_len) {
+    size_t len = strlen(path);
+    while (len > 0 && is_separator(path[len - 1]))
+        len--;
+    if (len == 0)
+        return 0;
 
-        cluster = read_fat_entry(file, cluster, fat_start_sector);
-    }
+    size_t start = len;
+    while (start > 0 && !is_separator(path[start - 1]))
+        start--;
+
+    *parent_len = start;
+    *name = path + start;
+    *name_len = len - start;
+    return 1;
+}
+
+static uint32_t entry_cluster(const fat32_dir_entry_t *entry) {
+    return ((uint32_t)le16toh(entry->fst_clus_hi) << 16) | le16toh(entry->fst_clus_lo);
+}
 
+// every access to the image goes through vol_read and vol_write. Both are positional and share no
+// file position, so concurrent reads are safe as long as nothing writes
+static int vol_read(fat32_volume_t *vol, off_t offset, void *buf, size_t len) {
+    if (vol->overlay)
+        return overlay_read(vol->overlay, offset, buf, len);
+
+    uint8_t *dest = buf;
+    while (len > 0) {
+        ssize_t n = pread(fileno(vol->file), dest, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        dest += n;
+        offset += n;
+        len -= n;
+    }
     return 0;
 }
 
-static int find_dir_entry(FILE *file,
-                          uint32_t start_cluster,
-                          const char *name,
-                          fat32_bpb_t *bpb,
-                          uint32_t data_start_sector,
-                          uint32_t fat_start_sector) {
-    return find_dir_entry_cluster(file,
-                                  start_cluster,
-                                  name,
-                                  bpb,
-                                  data_start_sector,
-                                  fat_start_sector) != 0
-               ? 1
-               : -1;
-}
-
-static uint32_t find_parent_cluster(FILE *file,
-                                    const char *path,
-                                    fat32_bpb_t *bpb,
-                                    uint32_t data_start_sector,
-                                    uint32_t fat_start_sector) {
-    if (strcmp(path, "/") == 0 || strcmp(path, "\\") == 0 || strlen(path) == 0) {
-        return le32toh(bpb->root_clus);
-    }
-
-    char *path_copy = strdup(path);
-    if (!path_copy)
-        return 0;
+static uint32_t unit_of(fat32_volume_t *vol, off_t offset) {
+    uint32_t sector = offset >> vol->sector_shift;
+    if (sector < vol->data_start)
+        return sector;
+    return vol->data_start + ((sector - vol->data_start) >> vol->sec_per_clus_shift);
+}
 
-    int len = strlen(path_copy);
-    while (len > 1 && (path_copy[len - 1] == '/' || path_copy[len - 1] == '\\')) {
-        path_copy[len - 1] = '\0';
-        len--;
+static void unit_range(fat32_volume_t *vol, uint32_t unit, off_t *offset, size_t *len) {
+    if (unit < vol->data_start) {
+        *offset = (off_t)unit << vol->sector_shift;
+        *len = vol->sector_size;
+    } else {
+        *offset = vol->data_offset + ((off_t)(unit - vol->data_start) << vol->cluster_shift);
+        *len = vol->cluster_size;
     }
+}
 
-    char *last_slash = strrchr(path_copy, '/');
-    char *last_backslash = strrchr(path_copy, '\\');
-    char *separator = (last_slash > last_backslash) ? last_slash : last_backslash;
+static void track_write(fat32_volume_t *vol, off_t offset, size_t len) {
+    if (vol->checkpoint_count == 0 || len == 0)
+        return;
 
-    uint32_t parent_cluster;
+    uint32_t first = unit_of(vol, offset);
+    uint32_t last = unit_of(vol, offset + len - 1);
+    for (int i = 0; i < vol->checkpoint_count; i++)
+        dirty_map_mark(vol->checkpoints[i].map, first, last - first + 1);
+}
 
-    if (!separator) {
-        parent_cluster = le32toh(bpb->root_clus);
-    } else if (separator == path_copy) {
-        parent_cluster = le32toh(bpb->root_clus);
-    } else {
-        *separator = '\0';
-        parent_cluster =
-            find_parent_cluster(file, path_copy, bpb, data_start_sector, fat_start_sector);
-        *separator = '/';
+static int vol_write(fat32_volume_t *vol, off_t offset, const void *buf, size_t len) {
+    track_write(vol, offset, len);
 
-        if (parent_cluster == 0) {
-            free(path_copy);
-            return 0;
-        }
+    if (vol->overlay)
+        return overlay_write(vol->overlay, offset, buf, len);
 
-        char *parent_name = separator + 1;
-        char *parent_end = strrchr(path_copy, '/');
-        if (!parent_end)
-            parent_end = strrchr(path_copy, '\\');
-        if (parent_end && parent_end != separator) {
-            *separator = '\0';
-            parent_name = strrchr(path_copy, '/');
-            if (!parent_name)
-                parent_name = strrchr(path_copy, '\\');
-            if (parent_name)
-                parent_name++;
-            else
-                parent_name = path_copy;
-        }
+    const uint8_t *src = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fileno(vol->file), src, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        src += n;
+        offset += n;
+        len -= n;
     }
+    return 0;
+}
 
-    free(path_copy);
-    return parent_cluster;
+static int vol_flush(fat32_volume_t *vol) {
+    if (vol->overlay)
+        return overlay_flush(vol->overlay);
+    return fflush(vol->file);
 }
 
-static uint32_t resolve_path_to_cluster(FILE *file,
-                                        const char *path,
-                                        fat32_bpb_t *bpb,
-                                        uint32_t data_start_sector,
-                                        uint32_t fat_start_sector) {
+static off_t cluster_offset(fat32_volume_t *vol, uint32_t cluster) {
+    return vol->data_offset + ((off_t)(cluster - 2) << vol->cluster_shift);
+}
 
-    if (strcmp(path, "/") == 0 || strcmp(path, "\\") == 0 || strlen(path) == 0) {
-        return le32toh(bpb->root_clus);
+static int read_clusters(fat32_volume_t *vol, uint32_t cluster, uint32_t count, uint8_t *buf) {
+    if (vol_read(vol, cluster_offset(vol, cluster), buf, (size_t)count * vol->cluster_size)) {
+        fprintf(stderr, "failed to read cluster %u\n", cluster);
+        return -1;
     }
+    return 0;
+}
 
-    uint32_t current_cluster = le32toh(bpb->root_clus);
+static int write_clusters(fat32_volume_t *vol,
+                          uint32_t cluster,
+                          uint32_t count,
+                          const uint8_t *buf) {
+    if (vol_write(vol, cluster_offset(vol, cluster), buf, (size_t)count * vol->cluster_size)) {
+        fprintf(stderr, "failed to write cluster %u\n", cluster);
+        return -1;
+    }
+    return 0;
+}
 
-    char *path_copy = strdup(path);
-    if (!path_copy)
-        return 0;
+static int read_cluster(fat32_volume_t *vol, uint32_t cluster, uint8_t *buf) {
+    return read_clusters(vol, cluster, 1, buf);
+}
 
-    char *p = path_copy;
-    while (*p == '/' || *p == '\\')
-        p++;
+static int write_cluster(fat32_volume_t *vol, uint32_t cluster, const uint8_t *buf) {
+    return write_clusters(vol, cluster, 1, buf);
+}
 
-    int len = strlen(p);
-    while (len > 0 && (p[len - 1] == '/' || p[len - 1] == '\\')) {
-        p[len - 1] = '\0';
-        len--;
+static int fat_load_block(fat32_volume_t *vol, uint32_t block) {
+    uint32_t first = block << FAT_BLOCK_SHIFT;
+    uint32_t count = vol->fat.sectors - first;
+    if (count > FAT_BLOCK_SECTORS)
+        count = FAT_BLOCK_SECTORS;
+
+    if (vol_read(vol,
+                 (off_t)(vol->fat.active_start + first) << vol->sector_shift,
+                 (uint8_t *)vol->fat.entries + ((size_t)first << vol->sector_shift),
+                 (size_t)count << vol->sector_shift)) {
+        fprintf(stderr, "failed to read FAT\n");
+        return -1;
     }
 
-    if (strlen(p) == 0) {
-        free(path_copy);
-        return le32toh(bpb->root_clus);
-    }
+    vol->fat.loaded[block] = 1;
+    return 0;
+}
 
-    char *token = strtok(p, "/\\");
-    while (token != NULL) {
-        uint32_t next_cluster = find_dir_entry_cluster(file,
-                                                       current_cluster,
-                                                       token,
-                                                       bpb,
-                                                       data_start_sector,
-                                                       fat_start_sector);
-        if (next_cluster == 0) {
+static uint32_t *fat_slot(fat32_volume_t *vol, uint32_t cluster) {
+    if (cluster >= vol->fat.entry_count)
+        return NULL;
 
-            free(path_copy);
-            return 0;
-        }
-        current_cluster = next_cluster;
-        token = strtok(NULL, "/\\");
-    }
+    uint32_t block = cluster >> vol->fat.block_shift;
+    if (!vol->fat.loaded[block] && fat_load_block(vol, block))
+        return NULL;
 
-    free(path_copy);
-    return current_cluster;
+    return &vol->fat.entries[cluster];
 }
 
-int fat32_mkdir(const char *filesystem_path, const char *path) {
-    FILE *file = fopen(filesystem_path, "r+b");
-    if (!file) {
-        fprintf(stderr, "failed to open a filesysteam\n");
-        return -1;
-    }
+static uint32_t read_fat_entry(fat32_volume_t *vol, uint32_t cluster) {
+    uint32_t *slot = fat_slot(vol, cluster);
+    if (!slot)
+        return END_OF_CHAIN;
+    return le32toh(*slot) & 0x0FFFFFFF;
+}
 
-    fat32_bpb_t bpb;
-    fseek(file, 0, SEEK_SET);
-    if (fread(&bpb, sizeof(bpb), 1, file) != 1) {
-        fprintf(stderr, "failed to read BPB");
-        fclose(file);
-        return -1;
+// loads every block not yet cached, after which lookups no longer touch the cache and may run
+// from several threads
+static int fat_load_all(fat32_volume_t *vol) {
+    uint32_t blocks = (vol->fat.sectors + FAT_BLOCK_SECTORS - 1) >> FAT_BLOCK_SHIFT;
+
+    for (uint32_t block = 0; block < blocks; block++) {
+        if (!vol->fat.loaded[block] && fat_load_block(vol, block))
+            return -1;
     }
+    return 0;
+}
 
-    uint32_t fat_start_sector = le16toh(bpb.rsvd_sec_cnt);
-    uint32_t fat_size_sectors = le32toh(bpb.fat_sz32);
-    uint32_t data_start_sector = fat_start_sector + (bpb.num_fats * fat_size_sectors);
-    uint32_t cluster_size = le16toh(bpb.byts_per_sec) * bpb.sec_per_clus;
-    uint32_t total_clusters = (le32toh(bpb.tot_sec32) - data_start_sector) / bpb.sec_per_clus;
+static void write_fat_entry(fat32_volume_t *vol, uint32_t cluster, uint32_t value) {
+    uint32_t *slot = fat_slot(vol, cluster);
+    if (!slot)
+        return;
+
+    // the upper four bits are reserved and must be preserved
+    *slot = htole32((le32toh(*slot) & 0xF0000000) | (value & 0x0FFFFFFF));
+
+    uint32_t sector = cluster >> vol->fat.sector_shift;
+    if (!vol->fat.dirty[sector]) {
+        if (vol->fat.dirty_count == 0 || sector < vol->fat.dirty_first)
+            vol->fat.dirty_first = sector;
+        if (vol->fat.dirty_count == 0 || sector > vol->fat.dirty_last)
+            vol->fat.dirty_last = sector;
+        vol->fat.dirty_count++;
+        vol->fat.dirty[sector] = 1;
+    }
 
-    char *path_copy = strdup(path);
-    if (!path_copy) {
-        fprintf(stderr, "failed to allocate memory\n");
-        return -1;
+    if (vol->free_map && cluster >= 2 && cluster < vol->total_clusters + 2) {
+        uint64_t bit = 1ULL << (cluster & 63);
+        if ((value & 0x0FFFFFFF) == 0)
+            vol->free_map[cluster >> 6] |= bit;
+        else
+            vol->free_map[cluster >> 6] &= ~bit;
     }
-    char *dir_name = strdup(basename(path_copy));
-    if (!dir_name) {
-        fprintf(stderr, "failed to allocate memory\n");
-        free(path_copy);
+}
+
+// scans the whole FAT into the free map, returns the number of free clusters or -1
+static int64_t build_free_map(fat32_volume_t *vol) {
+    if (fat_load_all(vol))
         return -1;
-    }
-    strcpy(path_copy, path);
-    char *parent_path = strdup(dirname(path_copy));
-    if (!parent_path) {
+
+    uint32_t limit = vol->total_clusters + 2;
+    uint64_t *map = calloc(((size_t)limit + 63) >> 6, sizeof(uint64_t));
+    if (!map) {
         fprintf(stderr, "failed to allocate memory\n");
-        free(dir_name);
-        free(path_copy);
         return -1;
     }
-    free(path_copy);
 
-    uint32_t parent_cluster =
-        resolve_path_to_cluster(file, parent_path, &bpb, data_start_sector, fat_start_sector);
-    if (parent_cluster == 0) {
-        fprintf(stderr, "parent directory not found: %s\n", parent_path);
-        free(dir_name);
-        free(parent_path);
-        fclose(file);
-        return -1;
+    int64_t free_clusters = 0;
+    for (uint32_t cluster = 2; cluster < limit; cluster++) {
+        if ((le32toh(vol->fat.entries[cluster]) & 0x0FFFFFFF) == 0) {
+            map[cluster >> 6] |= 1ULL << (cluster & 63);
+            free_clusters++;
+        }
     }
-    free(parent_path);
 
-    if (find_dir_entry(file, parent_cluster, dir_name, &bpb, data_start_sector, fat_start_sector) >
-        0) {
-        fprintf(stderr, "directory already exists\n");
-        free(dir_name);
-        fclose(file);
-        return -1;
-    }
+    free(vol->free_map);
+    vol->free_map = map;
+    return free_clusters;
+}
 
-    uint32_t new_cluster = find_free_cluster(file, fat_start_sector, total_clusters);
-    if (new_cluster == 0) {
-        fprintf(stderr, "no free clusters available\n");
-        free(dir_name);
-        fclose(file);
-        return -1;
+// first free cluster in [from, limit), 0 if there is none
+static uint32_t free_map_next(fat32_volume_t *vol, uint32_t from, uint32_t limit) {
+    if (from >= limit)
+        return 0;
+
+    uint32_t word = from >> 6;
+    uint32_t last = (limit - 1) >> 6;
+    uint64_t bits = vol->free_map[word] & (~0ULL << (from & 63));
+
+    while (bits == 0) {
+        if (++word > last)
+            return 0;
+        bits = vol->free_map[word];
     }
 
-    write_fat_entry(file, new_cluster, 0x0FFFFFFF, fat_start_sector, bpb.num_fats);
+    uint32_t cluster = (word << 6) + __builtin_ctzll(bits);
+    return cluster < limit ? cluster : 0;
+}
 
-    uint32_t new_dir_sector = data_start_sector + (new_cluster - 2) * bpb.sec_per_clus;
-    fseek(file, new_dir_sector * SECTOR_SIZE, SEEK_SET);
+static int fat_flush(fat32_volume_t *vol) {
+    if (vol->fat.dirty_count == 0)
+        return 0;
 
-    fat32_dir_entry_t dot_entry = {0};
-    memcpy(dot_entry.name, ".          ", 11);
-    dot_entry.attr = ATTR_DIRECTORY;
-    dot_entry.fst_clus_hi = htole16((new_cluster >> 16) & 0xFFFF);
-    dot_entry.fst_clus_lo = htole16(new_cluster & 0xFFFF);
-    dot_entry.crt_date = dot_entry.wrt_date = dot_entry.lst_acc_date = htole16(get_fat_date());
-    dot_entry.crt_time = dot_entry.wrt_time = htole16(get_fat_time());
-    fwrite(&dot_entry, sizeof(dot_entry), 1, file);
-
-    fat32_dir_entry_t dotdot_entry = {0};
-    memcpy(dotdot_entry.name, "..         ", 11);
-    dotdot_entry.attr = ATTR_DIRECTORY;
-    dotdot_entry.fst_clus_hi = htole16((parent_cluster >> 16) & 0xFFFF);
-    dotdot_entry.fst_clus_lo = htole16(parent_cluster & 0xFFFF);
-    dotdot_entry.crt_date = dotdot_entry.wrt_date = dotdot_entry.lst_acc_date =
-        htole16(get_fat_date());
-    dotdot_entry.crt_time = dotdot_entry.wrt_time = htole16(get_fat_time());
-    fwrite(&dotdot_entry, sizeof(dotdot_entry), 1, file);
-
-    uint8_t *zero_buf = calloc(cluster_size - 2, sizeof(fat32_dir_entry_t));
-    if (!zero_buf) {
-        fprintf(stderr, "failed to allocate memory\n");
-        free(dir_name);
-        return -1;
-    }
-    fwrite(zero_buf, sizeof(zero_buf), 1, file);
+    uint32_t sector = vol->fat.dirty_first;
+    uint32_t last = vol->fat.dirty_last;
+    vol->fat.dirty_count = 0;
 
-    uint32_t cluster = parent_cluster;
-    while (cluster < 0x0FFFFFF8) {
-        uint32_t sector = data_start_sector + (cluster - 2) * bpb.sec_per_clus;
-        fseek(file, sector * SECTOR_SIZE, SEEK_SET);
+    while (sector <= last) {
+        if (!vol->fat.dirty[sector]) {
+            sector++;
+            continue;
+        }
 
-        fat32_dir_entry_t entry;
-        for (int i = 0; i < cluster_size / sizeof(fat32_dir_entry_t); i++) {
-            long pos = ftell(file);
-            fread(&entry, sizeof(entry), 1, file);
-
-            if (entry.name[0] == 0 || entry.name[0] == 0xE5) {
-                fseek(file, pos, SEEK_SET);
-
-                fat32_dir_entry_t new_entry = {0};
-                name_to_83(dir_name, new_entry.name);
-                new_entry.attr = ATTR_DIRECTORY;
-                new_entry.fst_clus_hi = htole16((new_cluster >> 16) & 0xFFFF);
-                new_entry.fst_clus_lo = htole16(new_cluster & 0xFFFF);
-                new_entry.crt_date = new_entry.wrt_date = new_entry.lst_acc_date =
-                    htole16(get_fat_date());
-                new_entry.crt_time = new_entry.wrt_time = htole16(get_fat_time());
-
-                fwrite(&new_entry, sizeof(new_entry), 1, file);
-
-                free(dir_name);
-                fclose(file);
-                return 0;
-            }
+        uint32_t run_start = sector;
+        while (sector <= last && vol->fat.dirty[sector]) {
+            vol->fat.dirty[sector] = 0;
+            sector++;
+        }
+
+        const uint8_t *data = (const uint8_t *)vol->fat.entries +
+                              ((size_t)run_start << vol->sector_shift);
+        size_t len = (size_t)(sector - run_start) << vol->sector_shift;
+
+        off_t offset = (off_t)(vol->fat.active_start + run_start) << vol->sector_shift;
+        if (vol_write(vol, offset, data, len)) {
+            fprintf(stderr, "failed to write FAT\n");
+            // what was not written stays dirty for the next write back
+            memset(vol->fat.dirty + run_start, 1, sector - run_start);
+            vol->fat.dirty_first = run_start;
+            vol->fat.dirty_last = last;
+            for (uint32_t i = run_start; i <= last; i++)
+                vol->fat.dirty_count += vol->fat.dirty[i];
+            return -1;
         }
 
-        cluster = read_fat_entry(file, cluster, fat_start_sector);
+        if (!vol->fat.stale)
+            continue;
+        if (vol->fat.stale_count == 0 || run_start < vol->fat.stale_first)
+            vol->fat.stale_first = run_start;
+        if (vol->fat.stale_count == 0 || sector - 1 > vol->fat.stale_last)
+            vol->fat.stale_last = sector - 1;
+        for (uint32_t i = run_start; i < sector; i++) {
+            vol->fat.stale_count += !vol->fat.stale[i];
+            vol->fat.stale[i] = 1;
+        }
     }
 
-    fprintf(stderr, "parent directory is full\n");
-    free(dir_name);
-    fclose(file);
-    return -1;
+    return 0;
 }
 
-int fat32_touch(const char *filesystem_path, const char *path) {
-    FILE *file = fopen(filesystem_path, "r+b");
-    if (!file) {
-        fprintf(stderr, "failed to open a filesysteam\n");
+// a directory entry may only point at clusters the FAT on disk already has in use, otherwise a
+// process killed inside a batch, or before the operation's write back, leaves entries pointing at
+// free clusters. The FAT goes out ahead of every entry write that can add such a reference
+static int write_dir_entry(fat32_volume_t *vol,
+                           const dir_slot_t *slot,
+                           const fat32_dir_entry_t *entry) {
+    if (fat_flush(vol))
         return -1;
-    }
 
-    fat32_bpb_t bpb;
-    fread(&bpb, sizeof(bpb), 1, file);
-
-    uint32_t fat_start = le16toh(bpb.rsvd_sec_cnt);
-    uint32_t fat_size = le32toh(bpb.fat_sz32);
-    uint32_t data_start = fat_start + bpb.num_fats * fat_size;
-    uint32_t total_clusters = (le32toh(bpb.tot_sec32) - data_start) / bpb.sec_per_clus;
-
-    char *path_copy = strdup(path);
-    char *file_name = strdup(basename(path_copy));
-    strcpy(path_copy, path);
-    char *dir_path = dirname(path_copy);
-
-    uint32_t dir_cluster = resolve_path_to_cluster(file, dir_path, &bpb, data_start, fat_start);
-    if (dir_cluster == 0) {
-        fprintf(stderr, "Directory not found: %s\n", dir_path);
-        free(file_name);
-        free(path_copy);
-        fclose(file);
+    off_t offset = cluster_offset(vol, slot->cluster) + slot->index * sizeof(fat32_dir_entry_t);
+    if (vol_write(vol, offset, entry, sizeof(*entry))) {
+        fprintf(stderr, "failed to write directory entry\n");
         return -1;
     }
+    return 0;
+}
 
-    if (find_dir_entry(file, dir_cluster, file_name, &bpb, data_start, fat_start) > 0) {
-        fprintf(stderr, "File already exists: %s\n", file_name);
-        free(file_name);
-        free(path_copy);
-        fclose(file);
+// copies the stale part of the active FAT to every mirror. Stale sectors are always cached, so
+// the span between the first and the last one goes out as a few sequential writes per mirror
+static int fat_mirror(fat32_volume_t *vol) {
+    if (vol->fat.stale_count == 0)
         return 0;
-    }
 
-    uint32_t cluster_size = le16toh(bpb.byts_per_sec) * bpb.sec_per_clus;
-    uint32_t cluster = dir_cluster;
-    while (cluster < 0x0FFFFFF8) {
-        uint32_t sector = data_start + (cluster - 2) * bpb.sec_per_clus;
-        fseek(file, sector * SECTOR_SIZE, SEEK_SET);
-        for (int i = 0; i < cluster_size / sizeof(fat32_dir_entry_t); i++) {
-            long pos = ftell(file);
-            fat32_dir_entry_t entry;
-            fread(&entry, sizeof(entry), 1, file);
-            if (entry.name[0] == 0 || entry.name[0] == 0xE5) {
-                fseek(file, pos, SEEK_SET);
-                fat32_dir_entry_t new_entry = {0};
-                name_to_83(file_name, new_entry.name);
-                new_entry.attr = ATTR_ARCHIVE;
-                new_entry.crt_date = new_entry.wrt_date = new_entry.lst_acc_date =
-                    htole16(get_fat_date());
-                new_entry.crt_time = new_entry.wrt_time = htole16(get_fat_time());
-                new_entry.file_size = 0;
-                fwrite(&new_entry, sizeof(new_entry), 1, file);
-                free(file_name);
-                free(path_copy);
-                fclose(file);
-                return 0;
+    for (int i = 0; i < vol->bpb.num_fats; i++) {
+        uint32_t mirror_start = vol->fat_start + i * vol->fat_size;
+        if (mirror_start == vol->fat.active_start)
+            continue;
+
+        uint32_t sector = vol->fat.stale_first;
+        while (sector <= vol->fat.stale_last) {
+            if (!vol->fat.loaded[sector >> FAT_BLOCK_SHIFT]) {
+                sector++;
+                continue;
+            }
+
+            uint32_t run_start = sector;
+            while (sector <= vol->fat.stale_last && vol->fat.loaded[sector >> FAT_BLOCK_SHIFT])
+                sector++;
+
+            const uint8_t *data = (const uint8_t *)vol->fat.entries +
+                                  ((size_t)run_start << vol->sector_shift);
+            size_t len = (size_t)(sector - run_start) << vol->sector_shift;
+            if (vol_write(vol, (off_t)(mirror_start + run_start) << vol->sector_shift, data, len)) {
+                fprintf(stderr, "failed to write FAT %d\n", i);
+                return -1;
             }
         }
-        cluster = read_fat_entry(file, cluster, fat_start);
     }
 
-    fprintf(stderr, "Directory is full\n");
-    free(file_name);
-    free(path_copy);
-    fclose(file);
-    return -1;
+    memset(vol->fat.stale + vol->fat.stale_first,
+           0,
+           vol->fat.stale_last - vol->fat.stale_first + 1);
+    vol->fat.stale_count = 0;
+    return 0;
 }
 
-int fat32_ls(const char *filesystem_path, const char *path) {
-    FILE *file = fopen(filesystem_path, "rb");
-    if (!file) {
-        fprintf(stderr, "failed to open a filesysteam\n");
-        return -1;
-    }
+static void adjust_free_count(fat32_volume_t *vol, int32_t delta) {
+    if (!vol->fs_info_valid)
+        return;
 
-    fat32_bpb_t bpb;
-    fread(&bpb, sizeof(bpb), 1, file);
+    uint32_t free_count = le32toh(vol->fs_info.free_count);
+    if (free_count == FS_INFO_UNKNOWN)
+        return;
 
-    uint32_t fat_start = le16toh(bpb.rsvd_sec_cnt);
-    uint32_t fat_size = le32toh(bpb.fat_sz32);
-    uint32_t data_start = fat_start + bpb.num_fats * fat_size;
-    uint32_t cluster_size = le16toh(bpb.byts_per_sec) * bpb.sec_per_clus;
+    vol->fs_info.free_count = htole32(free_count + delta);
+    vol->fs_info_dirty = 1;
+}
 
-    uint32_t dir_cluster = resolve_path_to_cluster(file, path, &bpb, data_start, fat_start);
-    if (dir_cluster == 0) {
-        fprintf(stderr, "Directory not found: %s\n", path);
-        fclose(file);
-        return -1;
-    }
+static void queue_punch(fat32_volume_t *vol, uint32_t cluster) {
+    if (vol->punch_disabled)
+        return;
 
-    while (dir_cluster < 0x0FFFFFF8) {
-        uint32_t sector = data_start + (dir_cluster - 2) * bpb.sec_per_clus;
-        fseek(file, sector * SECTOR_SIZE, SEEK_SET);
-        for (int i = 0; i < cluster_size / sizeof(fat32_dir_entry_t); i++) {
-            fat32_dir_entry_t entry;
-            fread(&entry, sizeof(entry), 1, file);
-            if (entry.name[0] == 0)
-                break;
-            if (entry.name[0] == 0xE5)
-                continue;
+    if (vol->punch_count > 0) {
+        cluster_run_t *last = &vol->punch_runs[vol->punch_count - 1];
+        if (last->first + last->count == cluster) {
+            last->count++;
+            return;
+        }
+    }
 
-            char name[12] = {0};
-            memcpy(name, entry.name, 11);
-            for (int j = 10; j >= 0; j--) {
-                if (name[j] != ' ')
-                    break;
-                name[j] = '\0';
-            }
+    if (vol->punch_count == vol->punch_capacity) {
+        size_t capacity = vol->punch_capacity ? vol->punch_capacity * 2 : 64;
+        cluster_run_t *tmp = realloc(vol->punch_runs, capacity * sizeof(cluster_run_t));
+        if (!tmp)
+            return;
+        vol->punch_runs = tmp;
+        vol->punch_capacity = capacity;
+    }
 
-            printf("%s ", name);
-        }
+    vol->punch_runs[vol->punch_count].first = cluster;
+    vol->punch_runs[vol->punch_count].count = 1;
+    vol->punch_count++;
+}
 
-        putchar('\n');
+static int punch_run(fat32_volume_t *vol, uint32_t first, uint32_t count) {
+    if (vol->punch_disabled)
+        return 0;
 
-        dir_cluster = read_fat_entry(file, dir_cluster, fat_start);
+    if (fallocate(fileno(vol->file),
+                  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  cluster_offset(vol, first),
+                  (off_t)count * vol->cluster_size)) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            vol->punch_disabled = 1;
+            return 0;
+        }
+        fprintf(stderr, "failed to punch clusters %u-%u\n", first, first + count - 1);
+        return -1;
     }
 
-    fclose(file);
     return 0;
 }
 
-int fat32_is_directory(const char *filesystem_path, const char *path) {
-    FILE *file = fopen(filesystem_path, "rb");
-    if (!file) {
-        fprintf(stderr, "failed to open a filesysteam\n");
-        return 0;
-    }
+// punches the queued runs, skipping clusters that were allocated again by the same operation
+static int punch_queued(fat32_volume_t *vol) {
+    int ret = 0;
 
-    fat32_bpb_t bpb;
-    if (fread(&bpb, sizeof(bpb), 1, file) != 1) {
-        fprintf(stderr, "failed to read BPB");
-        fclose(file);
-        return 0;
+    for (size_t i = 0; i < vol->punch_count; i++) {
+        uint32_t end = vol->punch_runs[i].first + vol->punch_runs[i].count;
+        uint32_t cluster = vol->punch_runs[i].first;
+
+        while (cluster < end) {
+            if (read_fat_entry(vol, cluster) != 0) {
+                cluster++;
+                continue;
+            }
+
+            uint32_t start = cluster;
+            while (cluster < end && read_fat_entry(vol, cluster) == 0)
+                cluster++;
+            if (punch_run(vol, start, cluster - start))
+                ret = -1;
+        }
     }
 
-    uint32_t fat_start = le16toh(bpb.rsvd_sec_cnt);
-    uint32_t fat_size = le32toh(bpb.fat_sz32);
-    uint32_t data_start = fat_start + bpb.num_fats * fat_size;
-    uint32_t cluster_size = le16toh(bpb.byts_per_sec) * bpb.sec_per_clus;
+    vol->punch_count = 0;
+    return ret;
+}
 
-    // Special case: root
-    if (strcmp(path, "/") == 0 || strcmp(path, "\\") == 0 || strlen(path) == 0) {
-        fclose(file);
-        return 1;
+// writes back everything an operation has changed, called once at the end of each operation
+static int volume_sync(fat32_volume_t *vol) {
+    int ret = fat_flush(vol);
+
+    if (vol->fs_info_dirty) {
+        off_t offset = (off_t)le16toh(vol->bpb.fs_info) << vol->sector_shift;
+        if (vol_write(vol, offset, &vol->fs_info, sizeof(vol->fs_info))) {
+            fprintf(stderr, "failed to write FSInfo\n");
+            ret = -1;
+        }
+        vol->fs_info_dirty = 0;
     }
 
-    char *path_copy = strdup(path);
-    char *entry_name = strdup(basename(path_copy));
-    strcpy(path_copy, path);
-    char *dir_path = dirname(path_copy);
+    if (vol_flush(vol))
+        ret = -1;
 
-    uint32_t dir_cluster = resolve_path_to_cluster(file, dir_path, &bpb, data_start, fat_start);
-    if (dir_cluster == 0) {
-        free(entry_name);
-        free(path_copy);
-        fclose(file);
-        return 0;
+    for (int i = 0; i < vol->checkpoint_count; i++) {
+        if (dirty_map_save(vol->checkpoints[i].map))
+            ret = -1;
     }
 
-    uint8_t target_name[11];
-    name_to_83(entry_name, target_name);
+    // only after the buffered writes are out, so none of them lands in a punched range
+    if (vol->punch_count && punch_queued(vol))
+        ret = -1;
 
-    while (dir_cluster < 0x0FFFFFF8) {
-        uint32_t sector = data_start + (dir_cluster - 2) * bpb.sec_per_clus;
-        fseek(file, sector * SECTOR_SIZE, SEEK_SET);
+    return ret;
+}
 
-        for (int i = 0; i < cluster_size / sizeof(fat32_dir_entry_t); i++) {
-            fat32_dir_entry_t entry;
-            fread(&entry, sizeof(entry), 1, file);
-            if (entry.name[0] == 0)
-                break;
-            if (entry.name[0] == 0xE5)
-                continue;
+// a sync after which every FAT copy is current, for unmounting and anything that reads the image
+// as a whole
+static int volume_sync_all(fat32_volume_t *vol) {
+    int ret = fat_flush(vol);
+    if (ret == 0 && fat_mirror(vol))
+        ret = -1;
+    if (volume_sync(vol))
+        ret = -1;
+    return ret;
+}
 
-            if (memcmp(entry.name, target_name, 11) == 0) {
-                int result = (entry.attr & ATTR_DIRECTORY) ? 1 : 0;
-                free(entry_name);
-                free(path_copy);
-                fclose(file);
-                return result;
-            }
+// clears the clean shutdown bit for as long as the volume is mounted. After a clean shutdown the
+// FSInfo counters are trusted and the free map waits for the first allocation, otherwise the FAT
+// is scanned now to rebuild them
+static int open_volume_state(fat32_volume_t *vol) {
+    uint32_t state = read_fat_entry(vol, 1);
+    uint32_t free_count = le32toh(vol->fs_info.free_count);
+    int clean = (state & FAT_CLEAN_SHUTDOWN) != 0;
+
+    if (!clean || !vol->fs_info_valid || free_count > vol->total_clusters) {
+        int64_t free_clusters = build_free_map(vol);
+        if (free_clusters < 0)
+            return -1;
+
+        if (vol->fs_info_valid) {
+            uint32_t next = le32toh(vol->fs_info.nxt_free);
+            vol->fs_info.free_count = htole32((uint32_t)free_clusters);
+            if (next < 2 || next >= vol->total_clusters + 2)
+                vol->fs_info.nxt_free = htole32(2);
+            vol->fs_info_dirty = 1;
         }
 
-        dir_cluster = read_fat_entry(file, dir_cluster, fat_start);
+        // the mirrors may lag behind the active FAT, the scan just cached all of it
+        if (!clean && vol->fat.stale) {
+            memset(vol->fat.stale, 1, vol->fat.sectors);
+            vol->fat.stale_first = 0;
+            vol->fat.stale_last = vol->fat.sectors - 1;
+            vol->fat.stale_count = vol->fat.sectors;
+        }
     }
 
-    free(entry_name);
-    free(path_copy);
-    fclose(file);
-    return 0;
+    write_fat_entry(vol, 1, state & ~FAT_CLEAN_SHUTDOWN);
+    return volume_sync(vol);
 }
 
-int fat32_exists(const char *filesystem_path, const char *path) {
-    FILE *file = fopen(filesystem_path, "rb");
-    if (!file) {
-        fprintf(stderr, "failed to open a filesysteam\n");
+// ends an operation, inside a batch the write back is left to fat32_end_batch
+static int commit_op(fat32_volume_t *vol) {
+    if (vol->batch_depth > 0)
         return 0;
-    }
+    return volume_sync(vol);
+}
 
-    fat32_bpb_t bpb;
-    if (fread(&bpb, sizeof(bpb), 1, file) != 1) {
-        fprintf(stderr, "failed to read BPB");
-        fclose(file);
+// scans for a free cluster starting where the allocation policy says and wrapping around once.
+// goal is the cluster the caller would like to be close to
+static uint32_t find_free_cluster(fat32_volume_t *vol, uint32_t goal) {
+    uint32_t limit = vol->total_clusters + 2;
+    uint32_t start = 2;
+
+    if (vol->alloc_policy == FAT32_ALLOC_NEXT_FIT && vol->fs_info_valid)
+        start = le32toh(vol->fs_info.nxt_free);
+    else if (vol->alloc_policy == FAT32_ALLOC_GOAL)
+        start = goal;
+
+    if (start < 2 || start >= limit)
+        start = 2;
+
+    if (!vol->free_map && build_free_map(vol) < 0)
+        return 0;
+
+    uint32_t cluster = free_map_next(vol, start, limit);
+    if (cluster == 0)
+        cluster = free_map_next(vol, 2, start);
+    return cluster;
+}
+
+static uint32_t alloc_cluster(fat32_volume_t *vol, uint32_t goal) {
+    uint32_t cluster = find_free_cluster(vol, goal);
+    if (cluster == 0)
         return 0;
+
+    write_fat_entry(vol, cluster, 0x0FFFFFFF);
+    adjust_free_count(vol, -1);
+
+    if (vol->fs_info_valid) {
+        vol->fs_info.nxt_free = htole32(cluster + 1);
+        vol->fs_info_dirty = 1;
     }
 
-    uint32_t fat_start = le16toh(bpb.rsvd_sec_cnt);
-    uint32_t fat_size = le32toh(bpb.fat_sz32);
-    uint32_t data_start = fat_start + bpb.num_fats * fat_size;
-    uint32_t cluster_size = le16toh(bpb.byts_per_sec) * bpb.sec_per_clus;
+    return cluster;
+}
 
-    // Special case: root
-    if (strcmp(path, "/") == 0 || strcmp(path, "\\") == 0 || strlen(path) == 0) {
-        fclose(file);
-        return 1;
+static void dir_index_drop(fat32_volume_t *vol, uint32_t dir_cluster) {
+    for (int i = 0; i < DIR_INDEX_COUNT; i++) {
+        if (vol->indexes[i].dir_cluster == dir_cluster)
+            vol->indexes[i].dir_cluster = 0;
     }
+}
 
-    char *path_copy = strdup(path);
-    char *entry_name = strdup(basename(path_copy));
-    strcpy(path_copy, path);
-    char *dir_path = dirname(path_copy);
+static void dir_index_drop_all(fat32_volume_t *vol) {
+    for (int i = 0; i < DIR_INDEX_COUNT; i++)
+        vol->indexes[i].dir_cluster = 0;
+}
 
-    uint32_t dir_cluster = resolve_path_to_cluster(file, dir_path, &bpb, data_start, fat_start);
-    if (dir_cluster == 0) {
-        free(entry_name);
-        free(path_copy);
-        fclose(file);
-        return 0;
+static uint32_t chain_length(fat32_volume_t *vol, uint32_t cluster) {
+    uint32_t count = 0;
+
+    while (cluster >= 2 && cluster < END_OF_CHAIN && count <= vol->total_clusters) {
+        count++;
+        cluster = read_fat_entry(vol, cluster);
     }
+    return count;
+}
 
-    uint8_t target_name[11];
-    name_to_83(entry_name, target_name);
+// returns a whole chain to the free pool, the FAT and FSInfo are written back by volume_sync
+static uint32_t free_chain(fat32_volume_t *vol, uint32_t cluster) {
+    // the index of a directory being freed must not outlive it, its cluster may be reused
+    dir_index_drop(vol, cluster);
 
-    while (dir_cluster < 0x0FFFFFF8) {
-        uint32_t sector = data_start + (dir_cluster - 2) * bpb.sec_per_clus;
-        fseek(file, sector * SECTOR_SIZE, SEEK_SET);
+    uint32_t freed = 0;
 
-        for (int i = 0; i < cluster_size / sizeof(fat32_dir_entry_t); i++) {
-            fat32_dir_entry_t entry;
-            fread(&entry, sizeof(entry), 1, file);
-            if (entry.name[0] == 0)
-                break;
-            if (entry.name[0] == 0xE5)
-                continue;
+    while (cluster >= 2 && cluster < vol->total_clusters + 2) {
+        uint32_t next = read_fat_entry(vol, cluster);
+        if (next == 0)
+            break;
 
-            if (memcmp(entry.name, target_name, 11) == 0) {
-                free(entry_name);
-                free(path_copy);
-                fclose(file);
-                return 1;
-            }
-        }
+        write_fat_entry(vol, cluster, 0);
+        queue_punch(vol, cluster);
+        freed++;
+        cluster = next;
+    }
+
+    adjust_free_count(vol, freed);
+    return freed;
+}
 
-        dir_cluster = read_fat_entry(file, dir_cluster, fat_start);
+static int make_key(const char *name, size_t name_len, name_key_t *key) {
+    int len = vfat_decode(name, name_len, key->chars);
+    if (len < 0) {
+        fprintf(stderr, "invalid name: %.*s\n", (int)name_len, name);
+        return -1;
     }
 
-    free(entry_name);
-    free(path_copy);
-    fclose(file);
+    key->len = len;
+    key->hash = vfat_hash(key->chars, len);
     return 0;
 }
+
+static int is_long_name(const fat32_dir_entry_t *entry) {
+    return (entry->attr & 0x3F) == VFAT_ATTR_LONG_NAME;
+}
+
+// moves slot to the next entry of the directory, returns 0 at the end of the chain
+static int next_slot(fat32_volume_t *vol, dir_slot_t *slot) {
+    if (++slot->index < vol->entries_per_cluster)
+        return 1;
+
+    uint32_t next = read_fat_entry(vol, slot->cluster);
+    if (next < 2 || next >= END_OF_CHAIN)
+        return 0;
+
+    slot->cluster = next;
+    slot->index = 0;
+    return 1;
+}
+
+// reads or writes count consecutive entries from first on, which may continue in the next cluster
+// of the chain. last is left at the final entry
+static int transfer_span(fat32_volume_t *vol,
+                         dir_slot_t first,
+                         uint32_t count,
+                         fat32_dir_entry_t *entries,
+                         int write,
+                         dir_slot_t *last) {
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+    dir_slot_t slot = first;
+    uint32_t done = 0;
+
+    // see write_dir_entry
+    if (write && fat_flush(vol))
+        return -1;
+
+    while (1) {
+        uint32_t n = entries_per_cluster - slot.index;
+        if (n > count - done)
+            n = count - done;
+
+        off_t offset = cluster_offset(vol, slot.cluster) + slot.index * sizeof(fat32_dir_entry_t);
+        size_t len = n * sizeof(fat32_dir_entry_t);
+        if (write ? vol_write(vol, offset, entries + done, len)
+                  : vol_read(vol, offset, entries + done, len)) {
+            fprintf(stderr, "failed to %s directory entries\n", write ? "write" : "read");
+            return -1;
+        }
+
+        done += n;
+        slot.index += n - 1;
+        if (done == count)
+            break;
+
+        if (!next_slot(vol, &slot)) {
+            fprintf(stderr, "directory entries run past the end of the directory\n");
+            return -1;
+        }
+    }
+
+    if (last)
+        *last = slot;
+    return 0;
+}
+
+static void index_place(name_record_t *records, uint32_t capacity, const name_record_t *record) {
+    uint32_t i = record->hash & (capacity - 1);
+    while (records[i].count)
+        i = (i + 1) & (capacity - 1);
+    records[i] = *record;
+}
+
+static int dir_index_add(dir_index_t *index,
+                         uint32_t hash,
+                         const dir_span_t *span,
+                         uint8_t checksum) {
+    // kept at most half full
+    if ((index->used + 1) * 2 > index->capacity) {
+        uint32_t capacity = index->capacity ? index->capacity * 2 : DIR_INDEX_MIN_CAPACITY;
+        name_record_t *records = calloc(capacity, sizeof(name_record_t));
+        if (!records) {
+            fprintf(stderr, "failed to allocate memory\n");
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < index->capacity; i++) {
+            if (index->records[i].count)
+                index_place(records, capacity, &index->records[i]);
+        }
+        free(index->records);
+        index->records = records;
+        index->capacity = capacity;
+    }
+
+    name_record_t record;
+    record.hash = hash;
+    record.cluster = span->first.cluster;
+    record.index = span->first.index;
+    record.count = span->count;
+    record.checksum = checksum;
+    index_place(index->records, index->capacity, &record);
+    index->used++;
+    return 0;
+}
+
+// indexes the short name of raw and, if the span has one, its long name
+static int index_entry(dir_index_t *index, const fat32_dir_entry_t *raw, const dir_span_t *span) {
+    uint16_t chars[12];
+    uint32_t len = vfat_short_chars(raw->name, raw->nt_res, chars);
+    uint32_t short_hash = vfat_hash(chars, len);
+    uint8_t checksum = vfat_checksum(raw->name);
+
+    if (dir_index_add(index, short_hash, span, checksum))
+        return -1;
+
+    if (span->count > 1) {
+        uint32_t long_hash = vfat_hash(span->lfn.chars, span->lfn.len);
+        if (long_hash != short_hash && dir_index_add(index, long_hash, span, checksum))
+            return -1;
+    }
+    return 0;
+}
+
+static dir_index_t *dir_index_find(fat32_volume_t *vol, uint32_t dir_cluster) {
+    for (int i = 0; i < DIR_INDEX_COUNT; i++) {
+        if (vol->indexes[i].dir_cluster == dir_cluster) {
+            vol->indexes[i].last_use = ++vol->index_clock;
+            return &vol->indexes[i];
+        }
+    }
+    return NULL;
+}
+
+// scans a directory once and indexes every name in it, taking over the least recently used index
+static dir_index_t *dir_index_build(fat32_volume_t *vol, uint32_t dir_cluster) {
+    dir_index_t *index = &vol->indexes[0];
+    for (int i = 1; i < DIR_INDEX_COUNT && index->dir_cluster; i++) {
+        if (!vol->indexes[i].dir_cluster || vol->indexes[i].last_use < index->last_use)
+            index = &vol->indexes[i];
+    }
+
+    index->dir_cluster = 0;
+    index->used = 0;
+    index->live = 0;
+    index->tombstones = 0;
+    if (index->records)
+        memset(index->records, 0, index->capacity * sizeof(name_record_t));
+
+    size_t mark = vol->arena.used;
+    uint8_t *buf = arena_alloc(&vol->arena, vol->cluster_size);
+    if (!buf)
+        return NULL;
+
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+    uint32_t cluster = dir_cluster;
+    int end = 0;
+    int ret = 0;
+
+    dir_span_t span;
+    vfat_lfn_reset(&span.lfn);
+
+    while (!end && ret == 0 && cluster >= 2 && cluster < END_OF_CHAIN) {
+        if (read_cluster(vol, cluster, buf)) {
+            ret = -1;
+            break;
+        }
+
+        const fat32_dir_entry_t *entries = (const fat32_dir_entry_t *)buf;
+        for (uint32_t i = 0; i < entries_per_cluster; i++) {
+            const fat32_dir_entry_t *raw = &entries[i];
+            if (raw->name[0] == 0) {
+                end = 1;
+                break;
+            }
+            if (raw->name[0] == 0xE5) {
+                index->tombstones++;
+                vfat_lfn_reset(&span.lfn);
+                continue;
+            }
+            index->live++;
+            if (is_long_name(raw)) {
+                if (span.lfn.count == 0 || (raw->name[0] & 0x40)) {
+                    span.first.cluster = cluster;
+                    span.first.index = i;
+                }
+                vfat_lfn_feed(&span.lfn, (const uint8_t *)raw);
+                continue;
+            }
+            if (raw->attr & ATTR_VOLUME_ID) {
+                vfat_lfn_reset(&span.lfn);
+                continue;
+            }
+
+            if (vfat_lfn_matches(&span.lfn, raw->name)) {
+                span.count = span.lfn.count + 1;
+            } else {
+                span.first.cluster = cluster;
+                span.first.index = i;
+                span.count = 1;
+            }
+
+            if (index_entry(index, raw, &span)) {
+                ret = -1;
+                break;
+            }
+            vfat_lfn_reset(&span.lfn);
+        }
+
+        cluster = read_fat_entry(vol, cluster);
+    }
+
+    vol->arena.used = mark;
+    if (ret)
+        return NULL;
+
+    // an empty directory still gets a table to probe
+    if (!index->records) {
+        index->records = calloc(DIR_INDEX_MIN_CAPACITY, sizeof(name_record_t));
+        if (!index->records) {
+            fprintf(stderr, "failed to allocate memory\n");
+            return NULL;
+        }
+        index->capacity = DIR_INDEX_MIN_CAPACITY;
+    }
+
+    index->dir_cluster = dir_cluster;
+    index->last_use = ++vol->index_clock;
+    return index;
+}
+
+// reads the span a record points at, returns 1 if it still holds a name equal to key
+static int check_record(fat32_volume_t *vol,
+                        const name_record_t *record,
+                        const name_key_t *key,
+                        fat32_dir_entry_t *entry,
+                        dir_slot_t *slot,
+                        dir_span_t *span) {
+    fat32_dir_entry_t entries[VFAT_MAX_ENTRIES + 1];
+    dir_span_t found;
+    dir_slot_t last;
+
+    found.first.cluster = record->cluster;
+    found.first.index = record->index;
+    found.count = record->count;
+    if (transfer_span(vol, found.first, found.count, entries, 0, &last))
+        return -1;
+
+    const fat32_dir_entry_t *raw = &entries[found.count - 1];
+    if (raw->name[0] == 0 || raw->name[0] == 0xE5 || is_long_name(raw) ||
+        vfat_checksum(raw->name) != record->checksum)
+        return 0;
+
+    vfat_lfn_reset(&found.lfn);
+    for (uint32_t i = 0; i + 1 < found.count; i++) {
+        if (!is_long_name(&entries[i]))
+            return 0;
+        vfat_lfn_feed(&found.lfn, (const uint8_t *)&entries[i]);
+    }
+    if (found.count > 1 && !vfat_lfn_matches(&found.lfn, raw->name))
+        return 0;
+
+    uint16_t chars[12];
+    uint32_t len = vfat_short_chars(raw->name, raw->nt_res, chars);
+    if (!vfat_equal(chars, len, key->chars, key->len) &&
+        (found.count == 1 || !vfat_equal(found.lfn.chars, found.lfn.len, key->chars, key->len)))
+        return 0;
+
+    if (entry)
+        *entry = *raw;
+    if (slot)
+        *slot = last;
+    if (span)
+        *span = found;
+    return 1;
+}
+
+// looks a long or short name up through the directory's index. Returns 1 and fills entry, slot
+// (the short entry) and span if found, 0 if not found, -1 on error
+static int find_entry(fat32_volume_t *vol,
+                      uint32_t dir_cluster,
+                      const name_key_t *key,
+                      fat32_dir_entry_t *entry,
+                      dir_slot_t *slot,
+                      dir_span_t *span) {
+    dir_index_t *index = dir_index_find(vol, dir_cluster);
+    if (!index)
+        index = dir_index_build(vol, dir_cluster);
+    if (!index)
+        return -1;
+
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = key->hash & mask; index->records[i].count; i = (i + 1) & mask) {
+        if (index->records[i].hash != key->hash)
+            continue;
+
+        int ret = check_record(vol, &index->records[i], key, entry, slot, span);
+        if (ret != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+static void probe_alias(alias_probe_t *probe,
+                        const fat32_dir_entry_t *raw,
+                        uint8_t *used_tails,
+                        uint32_t limit) {
+    if (is_long_name(raw) || (raw->attr & ATTR_VOLUME_ID))
+        return;
+
+    if (probe->preferred && memcmp(raw->name, probe->preferred, 11) == 0)
+        probe->preferred_taken = 1;
+
+    uint32_t n = vfat_alias_number(probe->basis, raw->name);
+    if (n > 0 && n < limit)
+        used_tails[n / 8] |= 1 << (n % 8);
+}
+
+// finds count consecutive unused entries, growing the directory when it has no such run. With a
+// probe the whole directory is scanned in the same pass to find the short names in use, so picking
+// an alias takes one scan however many aliases of the basis exist. reused is set to the number of
+// tombstones in the run. Returns 1 if found, 0 if the volume is full, -1 on error
+static int find_free_run(fat32_volume_t *vol,
+                         uint32_t dir_cluster,
+                         uint32_t count,
+                         alias_probe_t *probe,
+                         dir_slot_t *first,
+                         uint32_t *reused) {
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+    size_t mark = vol->arena.used;
+    uint8_t *buf = arena_alloc(&vol->arena, vol->cluster_size);
+    if (!buf)
+        return -1;
+
+    // there are fewer short names than entries, so one tail below limit is always free
+    uint8_t *used_tails = NULL;
+    uint32_t limit = 0;
+    if (probe) {
+        limit = chain_length(vol, dir_cluster) * entries_per_cluster + 2;
+        size_t size = (limit + 7) / 8;
+        if (size > vol->used_tails_size) {
+            uint8_t *tmp = realloc(vol->used_tails, size);
+            if (!tmp) {
+                fprintf(stderr, "failed to allocate memory\n");
+                vol->arena.used = mark;
+                return -1;
+            }
+            vol->used_tails = tmp;
+            vol->used_tails_size = size;
+        }
+        used_tails = vol->used_tails;
+        memset(used_tails, 0, size);
+    }
+
+    uint32_t cluster = dir_cluster;
+    uint32_t last_cluster = 0;
+    dir_slot_t run = {0, 0};
+    uint32_t run_len = 0;
+    uint32_t run_tombstones = 0;
+    int found = 0;
+    int end = 0;
+    int ret = 0;
+
+    while (cluster >= 2 && cluster < END_OF_CHAIN) {
+        // nothing past the end marker is in use, it is only counted
+        if (!end && read_cluster(vol, cluster, buf)) {
+            ret = -1;
+            goto out;
+        }
+
+        const fat32_dir_entry_t *entries = (const fat32_dir_entry_t *)buf;
+        for (uint32_t i = 0; i < entries_per_cluster; i++) {
+            if (!end && entries[i].name[0] == 0)
+                end = 1;
+
+            if (!end && entries[i].name[0] != 0xE5) {
+                run_len = 0;
+                if (probe)
+                    probe_alias(probe, &entries[i], used_tails, limit);
+                continue;
+            }
+
+            if (run_len++ == 0) {
+                run.cluster = cluster;
+                run.index = i;
+                run_tombstones = 0;
+            }
+            if (!end)
+                run_tombstones++;
+            if (run_len == count && !found) {
+                found = 1;
+                *first = run;
+                *reused = run_tombstones;
+            }
+            if (found && (end || !probe))
+                goto done;
+        }
+
+        last_cluster = cluster;
+        cluster = read_fat_entry(vol, cluster);
+    }
+
+    if (!found && last_cluster != 0) {
+        // a free run at the end of the chain is continued into the new clusters
+        uint32_t missing = count - run_len;
+        uint32_t added = (missing + entries_per_cluster - 1) / entries_per_cluster;
+        uint32_t added_first = 0;
+        uint32_t prev = last_cluster;
+
+        memset(buf, 0, vol->cluster_size);
+        for (uint32_t i = 0; i < added; i++) {
+            uint32_t new_cluster = alloc_cluster(vol, prev + 1);
+            if (new_cluster == 0 || write_cluster(vol, new_cluster, buf)) {
+                if (new_cluster != 0) {
+                    free_chain(vol, new_cluster);
+                    ret = -1;
+                }
+                if (added_first != 0) {
+                    write_fat_entry(vol, last_cluster, 0x0FFFFFFF);
+                    free_chain(vol, added_first);
+                }
+                goto out;
+            }
+
+            write_fat_entry(vol, prev, new_cluster);
+            prev = new_cluster;
+            if (added_first == 0)
+                added_first = new_cluster;
+        }
+
+        if (run_len == 0) {
+            run.cluster = added_first;
+            run.index = 0;
+            run_tombstones = 0;
+        }
+        *first = run;
+        *reused = run_tombstones;
+        found = 1;
+    }
+
+done:
+    if (found) {
+        ret = 1;
+        if (probe) {
+            probe->tail = 1;
+            while (probe->tail < limit && (used_tails[probe->tail / 8] & (1 << (probe->tail % 8))))
+                probe->tail++;
+        }
+    }
+
+out:
+    vol->arena.used = mark;
+    return ret;
+}
+
+// resolves the directory named by the first len bytes of path, returns 0 if not found
+static uint32_t resolve_dir(fat32_volume_t *vol, const char *path, size_t len) {
+    uint32_t current_cluster = vol->root_cluster;
+
+    path_iter_t it;
+    path_iter_init(&it, path, len);
+
+    const char *name;
+    size_t name_len;
+    while (path_iter_next(&it, &name, &name_len)) {
+        if (name_len == 1 && name[0] == '.')
+            continue;
+        if (name_len == 2 && name[0] == '.' && name[1] == '.' &&
+            current_cluster == vol->root_cluster)
+            continue;
+
+        name_key_t key;
+        if (make_key(name, name_len, &key))
+            return 0;
+
+        fat32_dir_entry_t entry;
+        if (find_entry(vol, current_cluster, &key, &entry, NULL, NULL) != 1)
+            return 0;
+        if (!(entry.attr & ATTR_DIRECTORY))
+            return 0;
+
+        current_cluster = entry_cluster(&entry);
+        if (current_cluster == 0)
+            current_cluster = vol->root_cluster;
+    }
+
+    return current_cluster;
+}
+
+static void init_dir_entry(fat32_dir_entry_t *entry,
+                           const uint8_t *name83,
+                           uint8_t attr,
+                           uint32_t cluster) {
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->name, name83, 11);
+    entry->attr = attr;
+    entry->fst_clus_hi = htole16((cluster >> 16) & 0xFFFF);
+    entry->fst_clus_lo = htole16(cluster & 0xFFFF);
+    entry->crt_date = entry->wrt_date = entry->lst_acc_date = htole16(get_fat_date());
+    entry->crt_time = entry->wrt_time = htole16(get_fat_time());
+}
+
+static void release_volume(fat32_volume_t *vol) {
+    for (int i = 0; i < vol->checkpoint_count; i++)
+        dirty_map_close(vol->checkpoints[i].map);
+    if (vol->overlay)
+        overlay_close(vol->overlay);
+    if (vol->file)
+        fclose(vol->file);
+    free(vol->fat.entries);
+    free(vol->fat.loaded);
+    free(vol->fat.dirty);
+    free(vol->fat.stale);
+    free(vol->free_map);
+    trace_close(vol->trace);
+    free(vol->spare_dir);
+    free(vol->dir_stack);
+    free(vol->used_tails);
+    free(vol->punch_runs);
+    for (int i = 0; i < DIR_INDEX_COUNT; i++)
+        free(vol->indexes[i].records);
+    free(vol->arena.base);
+    free(vol);
+}
+
+static int valid_checkpoint_name(const char *name, size_t len) {
+    if (len == 0 || len > CHECKPOINT_NAME_MAX)
+        return 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-')
+            return 0;
+    }
+    return 1;
+}
+
+static uint32_t checkpoint_units(fat32_volume_t *vol) {
+    return vol->data_start + vol->total_clusters;
+}
+
+static int checkpoint_path(fat32_volume_t *vol, const char *name, char *dest) {
+    int len = snprintf(dest, PATH_MAX, "%s.%s%s", vol->path, name, CHECKPOINT_SUFFIX);
+    return len > 0 && len < PATH_MAX ? 0 : -1;
+}
+
+static checkpoint_t *find_checkpoint(fat32_volume_t *vol, const char *name) {
+    for (int i = 0; i < vol->checkpoint_count; i++) {
+        if (strcmp(vol->checkpoints[i].name, name) == 0)
+            return &vol->checkpoints[i];
+    }
+    return NULL;
+}
+
+static int add_checkpoint(fat32_volume_t *vol, const char *name, size_t name_len, int reset) {
+    if (vol->checkpoint_count == MAX_CHECKPOINTS) {
+        fprintf(stderr, "too many checkpoints\n");
+        return -1;
+    }
+
+    checkpoint_t *checkpoint = &vol->checkpoints[vol->checkpoint_count];
+    memcpy(checkpoint->name, name, name_len);
+    checkpoint->name[name_len] = '\0';
+
+    char path[PATH_MAX];
+    if (checkpoint_path(vol, checkpoint->name, path)) {
+        fprintf(stderr, "checkpoint path is too long\n");
+        return -1;
+    }
+
+    checkpoint->map = dirty_map_open(path, checkpoint_units(vol), reset);
+    if (!checkpoint->map)
+        return -1;
+
+    vol->checkpoint_count++;
+    return 0;
+}
+
+// picks up every <image>.<name>.ckpt file next to the image
+static void load_checkpoints(fat32_volume_t *vol) {
+    char dir_path[PATH_MAX];
+    const char *base = strrchr(vol->path, '/');
+    if (base) {
+        size_t len = base == vol->path ? 1 : (size_t)(base - vol->path);
+        memcpy(dir_path, vol->path, len);
+        dir_path[len] = '\0';
+        base++;
+    } else {
+        strcpy(dir_path, ".");
+        base = vol->path;
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return;
+
+    size_t base_len = strlen(base);
+    size_t suffix_len = strlen(CHECKPOINT_SUFFIX);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *file_name = entry->d_name;
+        size_t len = strlen(file_name);
+        if (len <= base_len + 1 + suffix_len || strncmp(file_name, base, base_len) != 0 ||
+            file_name[base_len] != '.' ||
+            strcmp(file_name + len - suffix_len, CHECKPOINT_SUFFIX) != 0)
+            continue;
+
+        const char *name = file_name + base_len + 1;
+        size_t name_len = len - base_len - 1 - suffix_len;
+        if (valid_checkpoint_name(name, name_len))
+            add_checkpoint(vol, name, name_len, 0);
+    }
+
+    closedir(dir);
+}
+
+static int log2_of(uint32_t n) {
+    if (n == 0 || (n & (n - 1)) != 0)
+        return -1;
+
+    int shift = 0;
+    while ((1u << shift) < n)
+        shift++;
+    return shift;
+}
+
+// checks the BPB once and derives the shifts and masks every offset computation uses
+static int load_geometry(fat32_volume_t *vol) {
+    const fat32_bpb_t *bpb = &vol->bpb;
+    uint32_t sector_size = le16toh(bpb->byts_per_sec);
+    int sector_shift = log2_of(sector_size);
+    int sec_per_clus_shift = log2_of(bpb->sec_per_clus);
+
+    if (sector_shift < 0 || sector_size < MIN_SECTOR_SIZE || sector_size > MAX_SECTOR_SIZE) {
+        fprintf(stderr, "unsupported sector size %u\n", sector_size);
+        return -1;
+    }
+    if (sec_per_clus_shift < 0 || sector_size * bpb->sec_per_clus > MAX_CLUSTER_SIZE) {
+        fprintf(stderr, "unsupported cluster size of %u sectors\n", bpb->sec_per_clus);
+        return -1;
+    }
+
+    vol->sector_size = sector_size;
+    vol->sector_shift = sector_shift;
+    vol->sec_per_clus_shift = sec_per_clus_shift;
+    vol->cluster_shift = sector_shift + sec_per_clus_shift;
+    vol->cluster_size = 1u << vol->cluster_shift;
+    vol->cluster_mask = vol->cluster_size - 1;
+    vol->entries_per_cluster = vol->cluster_size / sizeof(fat32_dir_entry_t);
+
+    vol->fat_start = le16toh(bpb->rsvd_sec_cnt);
+    vol->fat_size = le32toh(bpb->fat_sz32);
+    vol->data_start = vol->fat_start + bpb->num_fats * vol->fat_size;
+    vol->data_offset = (off_t)vol->data_start << sector_shift;
+    vol->root_cluster = le32toh(bpb->root_clus);
+
+    uint32_t total_sectors = le32toh(bpb->tot_sec32);
+    if (vol->fat_start == 0 || bpb->num_fats == 0 || vol->fat_size == 0 ||
+        total_sectors <= vol->data_start) {
+        fprintf(stderr, "invalid BPB\n");
+        return -1;
+    }
+    vol->total_clusters = (total_sectors - vol->data_start) >> sec_per_clus_shift;
+
+    vol->fat.sectors = vol->fat_size;
+    vol->fat.sector_shift = sector_shift - 2;
+    vol->fat.block_shift = vol->fat.sector_shift + FAT_BLOCK_SHIFT;
+    vol->fat.entry_count = vol->fat_size << vol->fat.sector_shift;
+    if (vol->fat.entry_count < vol->total_clusters + 2) {
+        fprintf(stderr, "FAT is too small for %u clusters\n", vol->total_clusters);
+        return -1;
+    }
+
+    // with mirroring off only the FAT ext_flags names is in use, otherwise the first one is
+    // written on the hot path and the rest follow at full syncs
+    uint16_t ext_flags = le16toh(bpb->ext_flags);
+    uint32_t active = 0;
+    if (ext_flags & EXT_FLAGS_NO_MIRROR) {
+        active = ext_flags & EXT_FLAGS_ACTIVE_FAT;
+        if (active >= bpb->num_fats) {
+            fprintf(stderr, "active FAT %u does not exist\n", active);
+            return -1;
+        }
+    }
+    vol->fat.active_start = vol->fat_start + active * vol->fat_size;
+
+    if (vol->root_cluster < 2 || vol->root_cluster >= vol->total_clusters + 2) {
+        fprintf(stderr, "invalid root cluster %u\n", vol->root_cluster);
+        return -1;
+    }
+
+    return 0;
+}
+
+// takes ownership of either file or overlay
+static fat32_volume_t *mount_volume(FILE *file, overlay_t *overlay, const char *path) {
+    fat32_volume_t *vol = calloc(1, sizeof(fat32_volume_t));
+    if (!vol) {
+        fprintf(stderr, "failed to allocate memory\n");
+        if (overlay)
+            overlay_close(overlay);
+        if (file)
+            fclose(file);
+        return NULL;
+    }
+
+    vol->file = file;
+    vol->overlay = overlay;
+
+    if (strlen(path) >= PATH_MAX) {
+        fprintf(stderr, "path is too long\n");
+        release_volume(vol);
+        return NULL;
+    }
+    strcpy(vol->path, path);
+
+    fat32_bpb_t bpb;
+    if (vol_read(vol, 0, &bpb, sizeof(bpb))) {
+        fprintf(stderr, "failed to read BPB\n");
+        release_volume(vol);
+        return NULL;
+    }
+
+    vol->bpb = bpb;
+    if (load_geometry(vol)) {
+        release_volume(vol);
+        return NULL;
+    }
+    vol->alloc_policy = FAT32_ALLOC_GOAL;
+
+    // the base of an overlay is never written, there is nothing to give back to the host
+    vol->punch_disabled = overlay != NULL;
+
+    off_t fs_info_offset = (off_t)le16toh(bpb.fs_info) << vol->sector_shift;
+    if (le16toh(bpb.fs_info) < vol->fat_start &&
+        vol_read(vol, fs_info_offset, &vol->fs_info, sizeof(vol->fs_info)) == 0 &&
+        le32toh(vol->fs_info.lead_sig) == 0x41615252 &&
+        le32toh(vol->fs_info.struc_sig) == 0x61417272) {
+        vol->fs_info_valid = 1;
+    }
+
+    vol->fat.entries = malloc((size_t)vol->fat.sectors << vol->sector_shift);
+    vol->fat.loaded = calloc((vol->fat.sectors >> FAT_BLOCK_SHIFT) + 1, 1);
+    vol->fat.dirty = calloc(vol->fat.sectors, 1);
+    int mirrored = vol->bpb.num_fats > 1 && !(le16toh(vol->bpb.ext_flags) & EXT_FLAGS_NO_MIRROR);
+    if (mirrored)
+        vol->fat.stale = calloc(vol->fat.sectors, 1);
+
+    vol->arena.size = ARENA_CLUSTERS * vol->cluster_size;
+    vol->arena.base = malloc(vol->arena.size);
+
+    if (!vol->fat.entries || !vol->fat.loaded || !vol->fat.dirty || !vol->arena.base ||
+        (mirrored && !vol->fat.stale)) {
+        fprintf(stderr, "failed to allocate memory\n");
+        release_volume(vol);
+        return NULL;
+    }
+
+    // after the checkpoints, so their dirty maps see the state written here
+    load_checkpoints(vol);
+
+    if (open_volume_state(vol)) {
+        release_volume(vol);
+        return NULL;
+    }
+
+    return vol;
+}
+
+fat32_volume_t *fat32_mount(const char *filesystem_path) {
+    FILE *file = fopen(filesystem_path, "r+b");
+    if (!file) {
+        fprintf(stderr, "failed to open a filesysteam\n");
+        return NULL;
+    }
+
+    // two processes writing the same image would corrupt it
+    if (flock(fileno(file), LOCK_EX | LOCK_NB)) {
+        fprintf(stderr, "%s is mounted by another process\n", filesystem_path);
+        fclose(file);
+        return NULL;
+    }
+
+    return mount_volume(file, NULL, filesystem_path);
+}
+
+fat32_volume_t *fat32_mount_overlay(const char *base_path, const char *delta_path) {
+    FILE *base = fopen(base_path, "rb");
+    if (!base) {
+        fprintf(stderr, "failed to open a filesysteam\n");
+        return NULL;
+    }
+
+    // a new delta tracks cluster sized blocks lined up with the data region, so every cluster is
+    // exactly one block
+    fat32_bpb_t bpb;
+    if (fread(&bpb, sizeof(bpb), 1, base) != 1) {
+        fprintf(stderr, "failed to read BPB\n");
+        fclose(base);
+        return NULL;
+    }
+
+    // checked before overlay_open, which creates the delta, so a bad base leaves no file behind
+    fat32_volume_t *probe = calloc(1, sizeof(fat32_volume_t));
+    if (!probe) {
+        fprintf(stderr, "failed to allocate memory\n");
+        fclose(base);
+        return NULL;
+    }
+    probe->bpb = bpb;
+    int ret = load_geometry(probe);
+    uint32_t block_size = probe->cluster_size;
+    uint64_t data_offset = probe->data_offset;
+    free(probe);
+    if (ret) {
+        fclose(base);
+        return NULL;
+    }
+
+    overlay_t *overlay = overlay_open(base, delta_path, block_size, data_offset);
+    if (!overlay)
+        return NULL;
+
+    return mount_volume(NULL, overlay, delta_path);
+}
+
+void fat32_unmount(fat32_volume_t *vol) {
+    if (!vol)
+        return;
+
+    // the bit only goes out once everything else is on disk
+    if (volume_sync_all(vol) == 0) {
+        write_fat_entry(vol, 1, read_fat_entry(vol, 1) | FAT_CLEAN_SHUTDOWN);
+        volume_sync_all(vol);
+    }
+    release_volume(vol);
+}
+
+static int start_checkpoint(fat32_volume_t *vol, const char *name) {
+    size_t name_len = strlen(name);
+    if (!valid_checkpoint_name(name, name_len)) {
+        fprintf(stderr, "invalid checkpoint name: %s\n", name);
+        return -1;
+    }
+
+    if (volume_sync_all(vol))
+        return -1;
+
+    checkpoint_t *checkpoint = find_checkpoint(vol, name);
+    if (checkpoint) {
+        dirty_map_clear(checkpoint->map);
+        return dirty_map_save(checkpoint->map);
+    }
+
+    return add_checkpoint(vol, name, name_len, 1);
+}
+
+int fat32_checkpoint(fat32_volume_t *vol, const char *name) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = start_checkpoint(vol, name);
+    trace_add(vol->trace, TRACE_CHECKPOINT, name, 0, 0, 0, start, ret);
+    return ret;
+}
+
+// the mounted volume keeps the clean shutdown bit cleared, but a flattened or diffed copy is
+// complete once written. Sets the bit in each FAT copy's FAT[1] that falls inside buf, which holds
+// len bytes of the image from offset
+static void mark_copy_clean(fat32_volume_t *vol, off_t offset, uint8_t *buf, size_t len) {
+    for (uint32_t i = 0; i < vol->bpb.num_fats; i++) {
+        off_t entry = ((off_t)(vol->fat_start + i * vol->fat_size) << vol->sector_shift) + 4;
+        if (entry < offset || entry + 4 > offset + (off_t)len)
+            continue;
+
+        uint32_t state;
+        memcpy(&state, buf + (entry - offset), 4);
+        state = htole32(le32toh(state) | FAT_CLEAN_SHUTDOWN);
+        memcpy(buf + (entry - offset), &state, 4);
+    }
+}
+
+static int64_t write_diff(fat32_volume_t *vol,
+                          const char *name,
+                          const char *output_path,
+                          int advance) {
+    checkpoint_t *checkpoint = find_checkpoint(vol, name);
+    if (!checkpoint) {
+        fprintf(stderr, "no such checkpoint: %s\n", name);
+        return -1;
+    }
+
+    if (volume_sync_all(vol))
+        return -1;
+
+    FILE *out = fopen(output_path, "wb");
+    if (!out) {
+        fprintf(stderr, "failed to create %s\n", output_path);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(DIFF_CHUNK_SIZE);
+    if (!buf) {
+        fprintf(stderr, "failed to allocate memory\n");
+        fclose(out);
+        return -1;
+    }
+
+    diff_header_t header = {0};
+    memcpy(header.magic, DIFF_MAGIC, 8);
+    header.version = htole32(DIFF_VERSION);
+    header.image_size = htole64((uint64_t)le32toh(vol->bpb.tot_sec32) << vol->sector_shift);
+
+    int64_t bytes = 0;
+    uint32_t records = 0;
+    uint32_t unit = 0;
+    uint32_t count;
+    int ret = fwrite(&header, sizeof(header), 1, out) == 1 ? 0 : -1;
+
+    // a run of units always covers one contiguous byte range of the image
+    while (ret == 0 && dirty_map_next_run(checkpoint->map, &unit, &count)) {
+        off_t start, last_start;
+        size_t len, last_len;
+        unit_range(vol, unit, &start, &len);
+        unit_range(vol, unit + count - 1, &last_start, &last_len);
+        uint64_t length = last_start + last_len - start;
+        unit += count;
+
+        // records carry a 32 bit length, split larger runs
+        while (ret == 0 && length > 0) {
+            uint32_t record_len = length > 0x80000000 ? 0x80000000 : (uint32_t)length;
+
+            diff_record_t record;
+            record.offset = htole64(start);
+            record.length = htole32(record_len);
+            if (fwrite(&record, sizeof(record), 1, out) != 1) {
+                ret = -1;
+                break;
+            }
+
+            for (uint32_t done = 0; done < record_len;) {
+                size_t chunk = record_len - done < DIFF_CHUNK_SIZE ? record_len - done
+                                                                   : DIFF_CHUNK_SIZE;
+                if (vol_read(vol, start + done, buf, chunk)) {
+                    ret = -1;
+                    break;
+                }
+                mark_copy_clean(vol, start + done, buf, chunk);
+                if (fwrite(buf, chunk, 1, out) != 1) {
+                    ret = -1;
+                    break;
+                }
+                done += chunk;
+            }
+
+            records++;
+            bytes += record_len;
+            start += record_len;
+            length -= record_len;
+        }
+    }
+
+    header.record_count = htole32(records);
+    if (ret == 0 && (fseek(out, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, out) != 1))
+        ret = -1;
+    if (fclose(out))
+        ret = -1;
+    free(buf);
+
+    if (ret) {
+        fprintf(stderr, "failed to write %s\n", output_path);
+        return -1;
+    }
+
+    if (advance) {
+        dirty_map_clear(checkpoint->map);
+        if (dirty_map_save(checkpoint->map))
+            return -1;
+    }
+
+    return bytes;
+}
+
+// the output path is not part of the record, a replay writes the diff to a scratch file
+int64_t fat32_diff(fat32_volume_t *vol, const char *name, const char *output_path, int advance) {
+    uint64_t start = trace_start(vol->trace);
+    int64_t ret = write_diff(vol, name, output_path, advance);
+    trace_add(vol->trace, TRACE_DIFF, name, advance != 0, 0, 0, start, ret);
+    return ret;
+}
+
+int fat32_apply_diff(const char *diff_path, const char *image_path) {
+    FILE *diff = fopen(diff_path, "rb");
+    if (!diff) {
+        fprintf(stderr, "failed to open %s\n", diff_path);
+        return -1;
+    }
+
+    FILE *image = fopen(image_path, "r+b");
+    if (!image) {
+        fprintf(stderr, "failed to open %s\n", image_path);
+        fclose(diff);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(DIFF_CHUNK_SIZE);
+    int ret = buf ? 0 : -1;
+
+    diff_header_t header;
+    if (ret == 0 && (fread(&header, sizeof(header), 1, diff) != 1 ||
+                     memcmp(header.magic, DIFF_MAGIC, 8) != 0 ||
+                     le32toh(header.version) != DIFF_VERSION)) {
+        fprintf(stderr, "%s is not an image diff\n", diff_path);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        fseeko(image, 0, SEEK_END);
+        if ((uint64_t)ftello(image) != le64toh(header.image_size)) {
+            fprintf(stderr, "%s does not match the size of the diffed image\n", image_path);
+            ret = -1;
+        }
+    }
+
+    uint32_t records = ret == 0 ? le32toh(header.record_count) : 0;
+    for (uint32_t i = 0; i < records && ret == 0; i++) {
+        diff_record_t record;
+        if (fread(&record, sizeof(record), 1, diff) != 1) {
+            ret = -1;
+            break;
+        }
+
+        uint64_t offset = le64toh(record.offset);
+        uint32_t length = le32toh(record.length);
+        if (offset + length > le64toh(header.image_size) ||
+            fseeko(image, offset, SEEK_SET)) {
+            ret = -1;
+            break;
+        }
+
+        for (uint32_t done = 0; done < length;) {
+            size_t chunk = length - done < DIFF_CHUNK_SIZE ? length - done : DIFF_CHUNK_SIZE;
+            if (fread(buf, chunk, 1, diff) != 1 || fwrite(buf, chunk, 1, image) != 1) {
+                ret = -1;
+                break;
+            }
+            done += chunk;
+        }
+    }
+
+    if (ret)
+        fprintf(stderr, "failed to apply %s\n", diff_path);
+
+    free(buf);
+    fclose(diff);
+    if (fclose(image))
+        ret = -1;
+    return ret;
+}
+
+static int flatten_volume(fat32_volume_t *vol, const char *output_path) {
+    if (volume_sync_all(vol))
+        return -1;
+
+    FILE *out = fopen(output_path, "wb");
+    if (!out) {
+        fprintf(stderr, "failed to create %s\n", output_path);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(FLATTEN_CHUNK_SIZE);
+    if (!buf) {
+        fprintf(stderr, "failed to allocate memory\n");
+        fclose(out);
+        return -1;
+    }
+
+    off_t size = (off_t)le32toh(vol->bpb.tot_sec32) << vol->sector_shift;
+    int ret = 0;
+
+    for (off_t offset = 0; offset < size && ret == 0; offset += FLATTEN_CHUNK_SIZE) {
+        size_t len = size - offset < FLATTEN_CHUNK_SIZE ? size - offset : FLATTEN_CHUNK_SIZE;
+        if (vol_read(vol, offset, buf, len)) {
+            fprintf(stderr, "failed to read image\n");
+            ret = -1;
+            break;
+        }
+        mark_copy_clean(vol, offset, buf, len);
+
+        // leave all-zero pieces as holes so the output stays sparse
+        for (size_t pos = 0; pos < len && ret == 0; pos += FLATTEN_HOLE_SIZE) {
+            size_t piece = len - pos < FLATTEN_HOLE_SIZE ? len - pos : FLATTEN_HOLE_SIZE;
+            size_t nonzero = 0;
+            while (nonzero < piece && buf[pos + nonzero] == 0)
+                nonzero++;
+            if (nonzero == piece)
+                continue;
+
+            if (fseeko(out, offset + pos, SEEK_SET) || fwrite(buf + pos, piece, 1, out) != 1) {
+                fprintf(stderr, "failed to write %s\n", output_path);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0 && (fflush(out) || ftruncate(fileno(out), size))) {
+        fprintf(stderr, "failed to write %s\n", output_path);
+        ret = -1;
+    }
+
+    free(buf);
+    fclose(out);
+    return ret;
+}
+
+int fat32_flatten(fat32_volume_t *vol, const char *output_path) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = flatten_volume(vol, output_path);
+    trace_add(vol->trace, TRACE_FLATTEN, NULL, 0, 0, 0, start, ret);
+    return ret;
+}
+
+// resolves the parent of a path that is about to be created, returns 0 if it does not exist or the
+// name is already taken
+static uint32_t prepare_entry(fat32_volume_t *vol, const char *path, name_key_t *key) {
+    size_t parent_len;
+    const char *name;
+    size_t name_len;
+    if (!path_split(path, &parent_len, &name, &name_len) ||
+        (name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+        fprintf(stderr, "invalid path: %s\n", path);
+        return 0;
+    }
+
+    uint32_t parent_cluster = resolve_dir(vol, path, parent_len);
+    if (parent_cluster == 0) {
+        fprintf(stderr, "parent directory not found: %.*s\n", (int)parent_len, path);
+        return 0;
+    }
+
+    if (make_key(name, name_len, key))
+        return 0;
+
+    int found = find_entry(vol, parent_cluster, key, NULL, NULL, NULL);
+    if (found != 0) {
+        if (found > 0)
+            fprintf(stderr, "%.*s already exists\n", (int)name_len, name);
+        return 0;
+    }
+
+    return parent_cluster;
+}
+
+// stores the name as a short entry alone when it is a valid 8.3 name in a single case, otherwise
+// behind long name entries, with its uppercase form or a ~N alias as the short name
+static int insert_entry(fat32_volume_t *vol,
+                        uint32_t parent_cluster,
+                        const name_key_t *key,
+                        uint8_t attr,
+                        uint32_t first_cluster,
+                        dir_slot_t *slot) {
+    uint8_t name83[11];
+    uint8_t basis[11];
+    uint8_t nt_res = 0;
+    int mixed_case = 0;
+    int fits = vfat_short_name(key->chars, key->len, name83, &nt_res, &mixed_case);
+
+    uint32_t lfn_count = 0;
+    alias_probe_t probe = {0};
+    if (!fits || mixed_case) {
+        lfn_count = vfat_lfn_entries(key->len);
+        nt_res = 0;
+        if (fits) {
+            memcpy(basis, name83, 11);
+            probe.preferred = name83;
+        } else {
+            vfat_basis(key->chars, key->len, basis);
+        }
+        probe.basis = basis;
+    }
+
+    dir_span_t span;
+    span.count = lfn_count + 1;
+    uint32_t reused = 0;
+    int ret = find_free_run(vol,
+                            parent_cluster,
+                            span.count,
+                            lfn_count ? &probe : NULL,
+                            &span.first,
+                            &reused);
+    if (ret <= 0) {
+        if (ret == 0)
+            fprintf(stderr, "parent directory is full\n");
+        return -1;
+    }
+
+    if (lfn_count && (!fits || probe.preferred_taken) && vfat_alias(basis, probe.tail, name83)) {
+        fprintf(stderr, "no short name alias left for this name\n");
+        return -1;
+    }
+
+    // the long name goes last part first, ahead of the short entry
+    fat32_dir_entry_t entries[VFAT_MAX_ENTRIES + 1];
+    uint8_t checksum = vfat_checksum(name83);
+    for (uint32_t i = 0; i < lfn_count; i++)
+        vfat_lfn_build((uint8_t *)&entries[i], key->chars, key->len, lfn_count - i, checksum);
+    init_dir_entry(&entries[lfn_count], name83, attr, first_cluster);
+    entries[lfn_count].nt_res = nt_res;
+
+    if (transfer_span(vol, span.first, span.count, entries, 1, slot))
+        return -1;
+
+    dir_index_t *index = dir_index_find(vol, parent_cluster);
+    if (index) {
+        index->live += span.count;
+        index->tombstones -= reused;
+        memcpy(span.lfn.chars, key->chars, key->len * sizeof(uint16_t));
+        span.lfn.len = key->len;
+        // an index missing a name would answer lookups wrongly, better none at all
+        if (index_entry(index, &entries[lfn_count], &span))
+            dir_index_drop(vol, parent_cluster);
+    }
+
+    return 0;
+}
+
+static int make_dir(fat32_volume_t *vol, const char *path) {
+    arena_reset(&vol->arena);
+
+    uint8_t *cluster_buf = arena_alloc(&vol->arena, vol->cluster_size);
+    if (!cluster_buf)
+        return -1;
+
+    name_key_t key;
+    uint32_t parent_cluster = prepare_entry(vol, path, &key);
+    if (parent_cluster == 0)
+        return -1;
+
+    // keep the new directory close to its parent
+    uint32_t new_cluster = alloc_cluster(vol, parent_cluster);
+    if (new_cluster == 0) {
+        fprintf(stderr, "no free clusters available\n");
+        return -1;
+    }
+
+    memset(cluster_buf, 0, vol->cluster_size);
+    fat32_dir_entry_t *entries = (fat32_dir_entry_t *)cluster_buf;
+    init_dir_entry(&entries[0], (const uint8_t *)".          ", ATTR_DIRECTORY, new_cluster);
+    init_dir_entry(&entries[1], (const uint8_t *)"..         ", ATTR_DIRECTORY, parent_cluster);
+
+    dir_slot_t slot;
+    if (write_cluster(vol, new_cluster, cluster_buf) ||
+        insert_entry(vol, parent_cluster, &key, ATTR_DIRECTORY, new_cluster, &slot)) {
+        free_chain(vol, new_cluster);
+        commit_op(vol);
+        return -1;
+    }
+
+    return commit_op(vol);
+}
+
+int fat32_mkdir(fat32_volume_t *vol, const char *path) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = make_dir(vol, path);
+    trace_add(vol->trace, TRACE_MKDIR, path, 0, 0, 0, start, ret);
+    return ret;
+}
+
+static int make_file(fat32_volume_t *vol, const char *path) {
+    arena_reset(&vol->arena);
+
+    name_key_t key;
+    uint32_t parent_cluster = prepare_entry(vol, path, &key);
+    if (parent_cluster == 0)
+        return -1;
+
+    dir_slot_t slot;
+    if (insert_entry(vol, parent_cluster, &key, ATTR_ARCHIVE, 0, &slot)) {
+        commit_op(vol);
+        return -1;
+    }
+
+    return commit_op(vol);
+}
+
+int fat32_touch(fat32_volume_t *vol, const char *path) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = make_file(vol, path);
+    trace_add(vol->trace, TRACE_TOUCH, path, 0, 0, 0, start, ret);
+    return ret;
+}
+
+static int is_dot_entry(const fat32_dir_entry_t *entry) {
+    return memcmp(entry->name, ".          ", 11) == 0 || memcmp(entry->name, "..         ", 11) == 0;
+}
+
+static int push_dir(fat32_volume_t *vol, size_t *depth, uint32_t cluster) {
+    if (*depth == vol->dir_stack_capacity) {
+        size_t capacity = vol->dir_stack_capacity ? vol->dir_stack_capacity * 2 : 64;
+        uint32_t *tmp = realloc(vol->dir_stack, capacity * sizeof(uint32_t));
+        if (!tmp) {
+            fprintf(stderr, "failed to allocate memory\n");
+            return -1;
+        }
+        vol->dir_stack = tmp;
+        vol->dir_stack_capacity = capacity;
+    }
+
+    vol->dir_stack[(*depth)++] = cluster;
+    return 0;
+}
+
+// frees every chain below the directory, depth first with an explicit stack. Child entries are
+// not tombstoned since the clusters holding them are freed as well. Returns 1 if the directory
+// has no entries other than . and .., 0 if it has, -1 on error
+static int free_dir_contents(fat32_volume_t *vol, uint32_t dir_cluster, int recursive) {
+    size_t mark = vol->arena.used;
+    uint8_t *buf = arena_alloc(&vol->arena, vol->cluster_size);
+    if (!buf)
+        return -1;
+
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+    size_t depth = 0;
+    int ret = 1;
+
+    if (push_dir(vol, &depth, dir_cluster)) {
+        vol->arena.used = mark;
+        return -1;
+    }
+
+    while (depth > 0) {
+        uint32_t top = vol->dir_stack[--depth];
+        uint32_t cluster = top;
+        int end = 0;
+
+        while (!end && cluster >= 2 && cluster < END_OF_CHAIN) {
+            if (read_cluster(vol, cluster, buf)) {
+                ret = -1;
+                goto out;
+            }
+
+            const fat32_dir_entry_t *entries = (const fat32_dir_entry_t *)buf;
+            for (uint32_t i = 0; i < entries_per_cluster; i++) {
+                if (entries[i].name[0] == 0) {
+                    end = 1;
+                    break;
+                }
+                if (entries[i].name[0] == 0xE5 || (entries[i].attr & ATTR_VOLUME_ID) ||
+                    is_dot_entry(&entries[i]))
+                    continue;
+
+                if (!recursive) {
+                    ret = 0;
+                    goto out;
+                }
+
+                uint32_t child = entry_cluster(&entries[i]);
+                if (entries[i].attr & ATTR_DIRECTORY) {
+                    if (child >= 2 && push_dir(vol, &depth, child)) {
+                        ret = -1;
+                        goto out;
+                    }
+                } else {
+                    free_chain(vol, child);
+                }
+            }
+
+            cluster = read_fat_entry(vol, cluster);
+        }
+
+        // the top level directory itself is freed by the caller together with its entry
+        if (top != dir_cluster)
+            free_chain(vol, top);
+    }
+
+out:
+    vol->arena.used = mark;
+    return ret;
+}
+
+// whether at least threshold percent of a directory's entries are tombstones, with a floor on
+// their number unless threshold is 0
+static int worth_compacting(uint32_t live, uint32_t tombstones, int threshold) {
+    if (tombstones == 0 || tombstones * 100 < (uint64_t)threshold * (live + tombstones))
+        return 0;
+    return threshold == 0 || tombstones >= COMPACT_MIN_TOMBSTONES;
+}
+
+// packs the live entries of a directory to the front of its chain, moves the end marker after
+// them and frees the clusters left unused. The first cluster never moves, so the directory's own
+// . entry and the .. entries of its children stay valid. Nothing is done unless at least
+// threshold percent of the scanned entries are tombstones. Returns the number of tombstones
+// dropped or -1 on error
+static int compact_dir(fat32_volume_t *vol, uint32_t dir_cluster, int threshold) {
+    size_t mark = vol->arena.used;
+    uint8_t *rbuf = arena_alloc(&vol->arena, vol->cluster_size);
+    uint8_t *wbuf = arena_alloc(&vol->arena, vol->cluster_size);
+    if (!rbuf || !wbuf) {
+        vol->arena.used = mark;
+        return -1;
+    }
+
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+    uint32_t live = 0;
+    uint32_t tombstones = 0;
+    uint32_t cluster = dir_cluster;
+    int end = 0;
+    int ret = 0;
+
+    while (!end && cluster >= 2 && cluster < END_OF_CHAIN) {
+        if (read_cluster(vol, cluster, rbuf)) {
+            ret = -1;
+            goto out;
+        }
+
+        const fat32_dir_entry_t *entries = (const fat32_dir_entry_t *)rbuf;
+        for (uint32_t i = 0; i < entries_per_cluster; i++) {
+            if (entries[i].name[0] == 0) {
+                end = 1;
+                break;
+            }
+            if (entries[i].name[0] == 0xE5)
+                tombstones++;
+            else
+                live++;
+        }
+
+        cluster = read_fat_entry(vol, cluster);
+    }
+
+    if (!worth_compacting(live, tombstones, threshold))
+        goto out;
+
+    // entries are about to move
+    dir_index_drop(vol, dir_cluster);
+
+    uint32_t rcluster = dir_cluster;
+    uint32_t wcluster = dir_cluster;
+    uint32_t full_cluster = 0;
+    uint32_t widx = 0;
+    end = 0;
+
+    // the write cursor never passes the read cursor, so a cluster is always read before it is
+    // overwritten
+    while (!end && rcluster >= 2 && rcluster < END_OF_CHAIN) {
+        if (read_cluster(vol, rcluster, rbuf)) {
+            ret = -1;
+            goto out;
+        }
+
+        const fat32_dir_entry_t *entries = (const fat32_dir_entry_t *)rbuf;
+        for (uint32_t i = 0; i < entries_per_cluster; i++) {
+            if (entries[i].name[0] == 0) {
+                end = 1;
+                break;
+            }
+            if (entries[i].name[0] == 0xE5)
+                continue;
+
+            memcpy(wbuf + widx * sizeof(fat32_dir_entry_t), &entries[i], sizeof(entries[i]));
+            if (++widx == entries_per_cluster) {
+                if (write_cluster(vol, wcluster, wbuf)) {
+                    ret = -1;
+                    goto out;
+                }
+                full_cluster = wcluster;
+                wcluster = read_fat_entry(vol, wcluster);
+                widx = 0;
+            }
+        }
+
+        rcluster = read_fat_entry(vol, rcluster);
+    }
+
+    uint32_t last_cluster;
+    if (widx == 0 && wcluster != dir_cluster) {
+        // the entries ended exactly on a cluster boundary, the end of the chain marks the end of
+        // the directory and the cluster at wcluster (if any) is already unused
+        last_cluster = full_cluster;
+    } else {
+        memset(wbuf + widx * sizeof(fat32_dir_entry_t),
+               0,
+               (entries_per_cluster - widx) * sizeof(fat32_dir_entry_t));
+        if (write_cluster(vol, wcluster, wbuf)) {
+            ret = -1;
+            goto out;
+        }
+        last_cluster = wcluster;
+    }
+
+    uint32_t next = read_fat_entry(vol, last_cluster);
+    if (next >= 2 && next < END_OF_CHAIN) {
+        write_fat_entry(vol, last_cluster, 0x0FFFFFFF);
+        free_chain(vol, next);
+    }
+
+    ret = tombstones;
+
+out:
+    vol->arena.used = mark;
+    return ret;
+}
+
+static int64_t trim_volume(fat32_volume_t *vol) {
+    if (vol->overlay) {
+        fprintf(stderr, "trim is not supported on overlays\n");
+        return -1;
+    }
+
+    if (volume_sync(vol))
+        return -1;
+
+    uint32_t limit = vol->total_clusters + 2;
+    uint32_t cluster = 2;
+    int64_t trimmed = 0;
+
+    while (cluster < limit) {
+        if (read_fat_entry(vol, cluster) != 0) {
+            cluster++;
+            continue;
+        }
+
+        uint32_t start = cluster;
+        while (cluster < limit && read_fat_entry(vol, cluster) == 0)
+            cluster++;
+        if (punch_run(vol, start, cluster - start))
+            return -1;
+        trimmed += cluster - start;
+    }
+
+    if (vol->punch_disabled) {
+        fprintf(stderr, "the host filesystem does not support punching holes\n");
+        return -1;
+    }
+
+    return trimmed;
+}
+
+int64_t fat32_trim(fat32_volume_t *vol) {
+    uint64_t start = trace_start(vol->trace);
+    int64_t ret = trim_volume(vol);
+    trace_add(vol->trace, TRACE_TRIM, NULL, 0, 0, 0, start, ret);
+    return ret;
+}
+
+void fat32_set_alloc_policy(fat32_volume_t *vol, int policy) {
+    uint64_t start = trace_start(vol->trace);
+    vol->alloc_policy = policy;
+    trace_add(vol->trace, TRACE_SET_ALLOC_POLICY, NULL, 0, 0, policy, start, 0);
+}
+
+static int compact_path(fat32_volume_t *vol, const char *path) {
+    arena_reset(&vol->arena);
+
+    uint32_t dir_cluster = resolve_dir(vol, path, strlen(path));
+    if (dir_cluster == 0) {
+        fprintf(stderr, "Directory not found: %s\n", path);
+        return -1;
+    }
+
+    int ret = compact_dir(vol, dir_cluster, 0);
+    if (commit_op(vol))
+        return -1;
+
+    return ret;
+}
+
+int fat32_compact(fat32_volume_t *vol, const char *path) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = compact_path(vol, path);
+    trace_add(vol->trace, TRACE_COMPACT, path, 0, 0, 0, start, ret);
+    return ret;
+}
+
+static int remove_entry(fat32_volume_t *vol, const char *path, int mode) {
+    arena_reset(&vol->arena);
+
+    size_t parent_len;
+    const char *name;
+    size_t name_len;
+    if (!path_split(path, &parent_len, &name, &name_len) ||
+        (name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+        fprintf(stderr, "refusing to remove %s\n", path);
+        return -1;
+    }
+
+    uint32_t parent_cluster = resolve_dir(vol, path, parent_len);
+    if (parent_cluster == 0) {
+        fprintf(stderr, "parent directory not found: %.*s\n", (int)parent_len, path);
+        return -1;
+    }
+
+    name_key_t key;
+    if (make_key(name, name_len, &key))
+        return -1;
+
+    fat32_dir_entry_t entry;
+    dir_span_t span;
+    int found = find_entry(vol, parent_cluster, &key, &entry, NULL, &span);
+    if (found <= 0) {
+        if (found == 0)
+            fprintf(stderr, "no such file or directory: %s\n", path);
+        return -1;
+    }
+
+    int is_dir = (entry.attr & ATTR_DIRECTORY) != 0;
+    uint32_t first_cluster = entry_cluster(&entry);
+
+    if (mode == RM_FILE && is_dir) {
+        fprintf(stderr, "%s is a directory\n", path);
+        return -1;
+    }
+    if (mode == RM_DIR && !is_dir) {
+        fprintf(stderr, "%s is not a directory\n", path);
+        return -1;
+    }
+
+    if (is_dir && first_cluster >= 2) {
+        int ret = free_dir_contents(vol, first_cluster, mode == RM_RECURSIVE);
+        if (ret < 0) {
+            commit_op(vol);
+            return -1;
+        }
+        if (ret == 0) {
+            fprintf(stderr, "directory not empty: %s\n", path);
+            return -1;
+        }
+    }
+
+    // the long name entries go with the short entry
+    fat32_dir_entry_t entries[VFAT_MAX_ENTRIES + 1];
+    if (transfer_span(vol, span.first, span.count, entries, 0, NULL))
+        return -1;
+    for (uint32_t i = 0; i < span.count; i++)
+        entries[i].name[0] = 0xE5;
+    if (transfer_span(vol, span.first, span.count, entries, 1, NULL))
+        return -1;
+
+    free_chain(vol, first_cluster);
+
+    // the parent's index counts its tombstones, only without one is the directory scanned
+    dir_index_t *index = dir_index_find(vol, parent_cluster);
+    if (index) {
+        index->live -= span.count;
+        index->tombstones += span.count;
+    }
+    if ((!index || worth_compacting(index->live, index->tombstones, COMPACT_TOMBSTONE_PERCENT)) &&
+        compact_dir(vol, parent_cluster, COMPACT_TOMBSTONE_PERCENT) < 0) {
+        commit_op(vol);
+        return -1;
+    }
+
+    return commit_op(vol);
+}
+
+int fat32_rm(fat32_volume_t *vol, const char *path, int recursive) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = remove_entry(vol, path, recursive ? RM_RECURSIVE : RM_FILE);
+    trace_add(vol->trace, TRACE_RM, path, recursive != 0, 0, 0, start, ret);
+    return ret;
+}
+
+int fat32_rmdir(fat32_volume_t *vol, const char *path) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = remove_entry(vol, path, RM_DIR);
+    trace_add(vol->trace, TRACE_RMDIR, path, 0, 0, 0, start, ret);
+    return ret;
+}
+
+typedef struct {
+    uint32_t first;
+    uint32_t is_dir;
+} defrag_chain_t;
+
+typedef struct {
+    defrag_chain_t *chains;
+    size_t count;
+    size_t capacity;
+    // original cluster -> target cluster, during the walk any non-zero value marks it reachable
+    uint32_t *map;
+    // physical cluster -> target of the data currently stored there, 0 for free clusters
+    uint32_t *target_at;
+    // target cluster -> physical cluster currently holding its data
+    uint32_t *source_of;
+} defrag_plan_t;
+
+static int plan_add_chain(defrag_plan_t *plan, uint32_t first, uint32_t is_dir) {
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity ? plan->capacity * 2 : 256;
+        defrag_chain_t *tmp = realloc(plan->chains, capacity * sizeof(defrag_chain_t));
+        if (!tmp) {
+            fprintf(stderr, "failed to allocate memory\n");
+            return -1;
+        }
+        plan->chains = tmp;
+        plan->capacity = capacity;
+    }
+
+    plan->chains[plan->count].first = first;
+    plan->chains[plan->count].is_dir = is_dir;
+    plan->count++;
+    return 0;
+}
+
+// marks a chain reachable and accounts it in stats, returns 0 if it was already marked
+static int plan_mark_chain(fat32_volume_t *vol,
+                           defrag_plan_t *plan,
+                           uint32_t first,
+                           fat32_frag_stats_t *stats) {
+    uint32_t limit = vol->total_clusters + 2;
+    if (first < 2 || first >= limit || plan->map[first])
+        return 0;
+
+    uint32_t breaks = 0;
+    uint32_t cluster = first;
+    while (cluster >= 2 && cluster < limit && !plan->map[cluster]) {
+        plan->map[cluster] = 1;
+        stats->clusters++;
+
+        uint32_t next = read_fat_entry(vol, cluster);
+        if (next >= 2 && next < END_OF_CHAIN && next != cluster + 1)
+            breaks++;
+        cluster = next;
+    }
+
+    stats->chains++;
+    stats->breaks += breaks;
+    if (breaks)
+        stats->fragmented++;
+    return 1;
+}
+
+// walks the tree from the root and records every chain, each directory comes before its files and
+// its subdirectories
+static int plan_walk(fat32_volume_t *vol, defrag_plan_t *plan, fat32_frag_stats_t *stats) {
+    size_t mark = vol->arena.used;
+    uint8_t *buf = arena_alloc(&vol->arena, vol->cluster_size);
+    if (!buf)
+        return -1;
+
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+    size_t depth = 0;
+    int ret = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    plan->count = 0;
+
+    if (push_dir(vol, &depth, vol->root_cluster)) {
+        vol->arena.used = mark;
+        return -1;
+    }
+
+    while (depth > 0) {
+        uint32_t dir_cluster = vol->dir_stack[--depth];
+        if (!plan_mark_chain(vol, plan, dir_cluster, stats))
+            continue;
+        if (plan_add_chain(plan, dir_cluster, 1)) {
+            ret = -1;
+            break;
+        }
+
+        size_t subdirs_start = depth;
+        uint32_t cluster = dir_cluster;
+        int end = 0;
+
+        while (!end && cluster >= 2 && cluster < END_OF_CHAIN) {
+            if (read_cluster(vol, cluster, buf)) {
+                ret = -1;
+                goto out;
+            }
+
+            const fat32_dir_entry_t *entries = (const fat32_dir_entry_t *)buf;
+            for (uint32_t i = 0; i < entries_per_cluster; i++) {
+                if (entries[i].name[0] == 0) {
+                    end = 1;
+                    break;
+                }
+                if (entries[i].name[0] == 0xE5 || (entries[i].attr & ATTR_VOLUME_ID) ||
+                    is_dot_entry(&entries[i]))
+                    continue;
+
+                uint32_t child = entry_cluster(&entries[i]);
+                if (entries[i].attr & ATTR_DIRECTORY) {
+                    if (push_dir(vol, &depth, child)) {
+                        ret = -1;
+                        goto out;
+                    }
+                } else if (plan_mark_chain(vol, plan, child, stats)) {
+                    if (plan_add_chain(plan, child, 0)) {
+                        ret = -1;
+                        goto out;
+                    }
+                }
+            }
+
+            cluster = read_fat_entry(vol, cluster);
+        }
+
+        // the stack pops the last pushed directory first, reverse so subdirectories keep their
+        // directory order
+        for (size_t i = subdirs_start, j = depth; i + 1 < j; i++, j--) {
+            uint32_t tmp = vol->dir_stack[i];
+            vol->dir_stack[i] = vol->dir_stack[j - 1];
+            vol->dir_stack[j - 1] = tmp;
+        }
+    }
+
+out:
+    vol->arena.used = mark;
+    return ret;
+}
+
+// gives every recorded chain a contiguous run of target clusters in walk order. Clusters that are
+// in use but not reachable from the root (bad or lost clusters) keep their place
+static void plan_targets(fat32_volume_t *vol, defrag_plan_t *plan) {
+    uint32_t limit = vol->total_clusters + 2;
+
+    for (uint32_t cluster = 2; cluster < limit; cluster++) {
+        if (!plan->map[cluster] && read_fat_entry(vol, cluster) != 0) {
+            plan->map[cluster] = cluster;
+            plan->target_at[cluster] = cluster;
+            plan->source_of[cluster] = cluster;
+        } else {
+            plan->map[cluster] = 0;
+        }
+    }
+
+    uint32_t target = 2;
+    for (size_t i = 0; i < plan->count; i++) {
+        uint32_t cluster = plan->chains[i].first;
+        while (cluster >= 2 && cluster < limit && !plan->map[cluster]) {
+            while (plan->source_of[target] == target && plan->map[target] == target)
+                target++;
+
+            plan->map[cluster] = target;
+            plan->target_at[cluster] = target;
+            plan->source_of[target] = cluster;
+            target++;
+
+            cluster = read_fat_entry(vol, cluster);
+        }
+    }
+}
+
+// moves the data into place. Targets are filled in ascending order, so everything below the
+// current target is final and its source always lies above it. Runs whose sources are contiguous
+// are swapped with whatever occupies the targets in one batch
+static int defrag_move(fat32_volume_t *vol, defrag_plan_t *plan, uint8_t *src_buf, uint8_t *dst_buf) {
+    uint32_t limit = vol->total_clusters + 2;
+
+    for (uint32_t target = 2; target < limit; target++) {
+        uint32_t src = plan->source_of[target];
+        if (src == 0 || src == target)
+            continue;
+
+        uint32_t count = 1;
+        int occupied = plan->target_at[target] != 0;
+        while (count < DEFRAG_BATCH_CLUSTERS && target + count < src &&
+               target + count < limit && plan->source_of[target + count] == src + count) {
+            occupied |= plan->target_at[target + count] != 0;
+            count++;
+        }
+
+        if (read_clusters(vol, src, count, src_buf))
+            return -1;
+        if (occupied) {
+            if (read_clusters(vol, target, count, dst_buf) ||
+                write_clusters(vol, src, count, dst_buf))
+                return -1;
+        }
+        if (write_clusters(vol, target, count, src_buf))
+            return -1;
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t displaced = plan->target_at[target + i];
+            plan->target_at[src + i] = displaced;
+            if (displaced)
+                plan->source_of[displaced] = src + i;
+            plan->target_at[target + i] = target + i;
+            plan->source_of[target + i] = target + i;
+        }
+
+        target += count - 1;
+    }
+
+    return 0;
+}
+
+static int defrag_rewrite(fat32_volume_t *vol, defrag_plan_t *plan, uint8_t *buf) {
+    uint32_t limit = vol->total_clusters + 2;
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+
+    // the chains are still linked by their original clusters, translate them while rebuilding the
+    // FAT from scratch
+    uint32_t *next = plan->target_at;
+    for (uint32_t cluster = 2; cluster < limit; cluster++)
+        next[cluster] = 0;
+
+    for (size_t i = 0; i < plan->count; i++) {
+        uint32_t cluster = plan->chains[i].first;
+        while (cluster >= 2 && cluster < limit && plan->map[cluster] &&
+               !next[plan->map[cluster]]) {
+            uint32_t following = read_fat_entry(vol, cluster);
+            next[plan->map[cluster]] = (following >= 2 && following < limit)
+                                           ? plan->map[following]
+                                           : 0x0FFFFFFF;
+            if (following < 2 || following >= limit)
+                break;
+            cluster = following;
+        }
+    }
+
+    for (uint32_t cluster = 2; cluster < limit; cluster++) {
+        if (plan->map[cluster] == cluster && plan->source_of[cluster] == cluster &&
+            next[cluster] == 0)
+            continue;
+        // a cluster the chains moved out of is given back to the host like a freed one
+        if (next[cluster] == 0 && read_fat_entry(vol, cluster) != 0)
+            queue_punch(vol, cluster);
+        write_fat_entry(vol, cluster, next[cluster]);
+    }
+
+    // the new chains are on disk before any entry points at them
+    if (fat_flush(vol))
+        return -1;
+
+    for (size_t i = 0; i < plan->count; i++) {
+        if (!plan->chains[i].is_dir)
+            continue;
+
+        uint32_t cluster = plan->map[plan->chains[i].first];
+        while (cluster >= 2 && cluster < END_OF_CHAIN) {
+            if (read_cluster(vol, cluster, buf))
+                return -1;
+
+            fat32_dir_entry_t *entries = (fat32_dir_entry_t *)buf;
+            int changed = 0;
+            for (uint32_t j = 0; j < entries_per_cluster; j++) {
+                if (entries[j].name[0] == 0)
+                    break;
+                if (entries[j].name[0] == 0xE5 || (entries[j].attr & ATTR_VOLUME_ID))
+                    continue;
+
+                uint32_t old = entry_cluster(&entries[j]);
+                if (old < 2 || old >= limit || plan->map[old] == 0 || plan->map[old] == old)
+                    continue;
+
+                uint32_t new_cluster = plan->map[old];
+                entries[j].fst_clus_hi = htole16((new_cluster >> 16) & 0xFFFF);
+                entries[j].fst_clus_lo = htole16(new_cluster & 0xFFFF);
+                changed = 1;
+            }
+
+            if (changed && write_cluster(vol, cluster, buf))
+                return -1;
+
+            cluster = read_fat_entry(vol, cluster);
+        }
+    }
+
+    uint32_t root = plan->map[vol->root_cluster];
+    if (root != vol->root_cluster) {
+        vol->root_cluster = root;
+        vol->bpb.root_clus = htole32(root);
+        if (vol_write(vol, 0, &vol->bpb, sizeof(vol->bpb))) {
+            fprintf(stderr, "failed to write BPB\n");
+            return -1;
+        }
+
+        // the backup boot sector must agree, it is what a damaged boot sector is repaired from
+        uint16_t backup = le16toh(vol->bpb.bk_boot_sec);
+        if (backup != 0 && backup < vol->fat_start &&
+            vol_write(vol, (off_t)backup << vol->sector_shift, &vol->bpb, sizeof(vol->bpb))) {
+            fprintf(stderr, "failed to write backup BPB\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int defrag_volume(fat32_volume_t *vol,
+                         fat32_frag_stats_t *before,
+                         fat32_frag_stats_t *after) {
+    arena_reset(&vol->arena);
+
+    size_t map_size = (size_t)(vol->total_clusters + 2) * sizeof(uint32_t);
+    size_t batch_size = (size_t)DEFRAG_BATCH_CLUSTERS * vol->cluster_size;
+
+    defrag_plan_t plan = {0};
+    plan.map = calloc(1, map_size);
+    plan.target_at = calloc(1, map_size);
+    plan.source_of = calloc(1, map_size);
+    uint8_t *src_buf = malloc(batch_size);
+    uint8_t *dst_buf = malloc(batch_size);
+
+    int ret = -1;
+    if (!plan.map || !plan.target_at || !plan.source_of || !src_buf || !dst_buf) {
+        fprintf(stderr, "failed to allocate memory\n");
+        goto out;
+    }
+
+    if (plan_walk(vol, &plan, before))
+        goto out;
+
+    plan_targets(vol, &plan);
+    dir_index_drop_all(vol);
+
+    if (defrag_move(vol, &plan, src_buf, dst_buf))
+        goto out;
+    if (defrag_rewrite(vol, &plan, src_buf))
+        goto out;
+    if (commit_op(vol))
+        goto out;
+
+    memset(plan.map, 0, map_size);
+    if (plan_walk(vol, &plan, after))
+        goto out;
+
+    ret = 0;
+
+out:
+    free(plan.chains);
+    free(plan.map);
+    free(plan.target_at);
+    free(plan.source_of);
+    free(src_buf);
+    free(dst_buf);
+    return ret;
+}
+
+int fat32_defrag(fat32_volume_t *vol, fat32_frag_stats_t *before, fat32_frag_stats_t *after) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = defrag_volume(vol, before, after);
+    trace_add(vol->trace, TRACE_DEFRAG, NULL, 0, 0, 0, start, ret);
+    return ret;
+}
+
+static fat32_dir_t *open_dir(fat32_volume_t *vol, const char *path) {
+    arena_reset(&vol->arena);
+
+    uint32_t dir_cluster = resolve_dir(vol, path, strlen(path));
+    if (dir_cluster == 0) {
+        fprintf(stderr, "Directory not found: %s\n", path);
+        return NULL;
+    }
+
+    // the cluster buffer lives in the same allocation as the handle, and a closed handle is kept
+    // by the volume for reuse, so listing directories does not allocate in steady state
+    fat32_dir_t *dir = vol->spare_dir;
+    vol->spare_dir = NULL;
+    if (!dir) {
+        dir = malloc(sizeof(fat32_dir_t) + vol->cluster_size);
+        if (!dir) {
+            fprintf(stderr, "failed to allocate memory\n");
+            return NULL;
+        }
+    }
+
+    dir->vol = vol;
+    dir->trace_path = NULL;
+    dir->cluster = dir_cluster;
+    dir->index = 0;
+    dir->loaded = 0;
+    dir->finished = 0;
+    vfat_lfn_reset(&dir->lfn);
+
+    return dir;
+}
+
+fat32_dir_t *fat32_opendir(fat32_volume_t *vol, const char *path) {
+    uint64_t start = trace_start(vol->trace);
+    fat32_dir_t *dir = open_dir(vol, path);
+    if (!dir) {
+        trace_add(vol->trace, TRACE_LS, path, 0, 0, 0, start, -1);
+        return NULL;
+    }
+
+    // without a copy of the path the listing goes unrecorded, the volume works the same
+    dir->trace_path = vol->trace ? strdup(path) : NULL;
+    dir->trace_start = start;
+    dir->entries = 0;
+    return dir;
+}
+
+// the long name collected in lfn if it belongs to raw, otherwise the short name
+static void fill_dirent(const fat32_dir_entry_t *raw,
+                        const vfat_lfn_t *lfn,
+                        fat32_dirent_t *entry) {
+    if (vfat_lfn_matches(lfn, raw->name)) {
+        vfat_encode(lfn->chars, lfn->len, entry->name);
+    } else {
+        uint16_t chars[12];
+        vfat_encode(chars, vfat_short_chars(raw->name, raw->nt_res, chars), entry->name);
+    }
+
+    entry->attr = raw->attr;
+    entry->size = le32toh(raw->file_size);
+    entry->first_cluster = entry_cluster(raw);
+    entry->crt_date = le16toh(raw->crt_date);
+    entry->crt_time = le16toh(raw->crt_time);
+    entry->wrt_date = le16toh(raw->wrt_date);
+    entry->wrt_time = le16toh(raw->wrt_time);
+    entry->acc_date = le16toh(raw->lst_acc_date);
+}
+
+int fat32_readdir(fat32_dir_t *dir, fat32_dirent_t *entry) {
+    fat32_volume_t *vol = dir->vol;
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+
+    while (!dir->finished) {
+        if (dir->cluster >= END_OF_CHAIN || dir->cluster < 2) {
+            dir->finished = 1;
+            break;
+        }
+
+        if (!dir->loaded) {
+            if (read_cluster(vol, dir->cluster, dir->buf))
+                return -1;
+            dir->loaded = 1;
+            dir->index = 0;
+        }
+
+        while (dir->index < entries_per_cluster) {
+            const fat32_dir_entry_t *raw =
+                (const fat32_dir_entry_t *)(dir->buf + dir->index * sizeof(fat32_dir_entry_t));
+            dir->index++;
+
+            if (raw->name[0] == 0) {
+                dir->finished = 1;
+                return 0;
+            }
+            if (is_long_name(raw) && raw->name[0] != 0xE5) {
+                vfat_lfn_feed(&dir->lfn, (const uint8_t *)raw);
+                continue;
+            }
+            if (raw->name[0] == 0xE5 || (raw->attr & ATTR_VOLUME_ID)) {
+                vfat_lfn_reset(&dir->lfn);
+                continue;
+            }
+
+            fill_dirent(raw, &dir->lfn, entry);
+            vfat_lfn_reset(&dir->lfn);
+            dir->entries++;
+            return 1;
+        }
+
+        dir->cluster = read_fat_entry(vol, dir->cluster);
+        dir->loaded = 0;
+    }
+
+    return 0;
+}
+
+void fat32_closedir(fat32_dir_t *dir) {
+    if (!dir)
+        return;
+
+    fat32_volume_t *vol = dir->vol;
+    if (dir->trace_path) {
+        trace_add(vol->trace, TRACE_LS, dir->trace_path, 0, 0, 0, dir->trace_start, dir->entries);
+        free(dir->trace_path);
+        dir->trace_path = NULL;
+    }
+
+    if (!vol->spare_dir)
+        vol->spare_dir = dir;
+    else
+        free(dir);
+}
+
+typedef struct {
+    uint32_t cluster;
+    int depth;
+    char path[];
+} walk_task_t;
+
+typedef struct {
+    fat32_volume_t *vol;
+    fat32_walk_fn fn;
+    void *arg;
+    // set by a callback asking to stop or by a failure, queued directories are then dropped
+    int stop;
+    int error;
+    // a cluster run buffer and a path buffer per worker
+    uint8_t *bufs;
+    char *paths;
+} walk_t;
+
+static void walk_fail(walk_t *walk) {
+    __atomic_store_n(&walk->error, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+}
+
+static int walk_submit(pool_t *pool,
+                       int worker,
+                       uint32_t cluster,
+                       int depth,
+                       const char *path,
+                       size_t len) {
+    walk_task_t *task = malloc(sizeof(walk_task_t) + len + 1);
+    if (!task) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return -1;
+    }
+
+    task->cluster = cluster;
+    task->depth = depth;
+    memcpy(task->path, path, len);
+    task->path[len] = '\0';
+
+    if (pool_submit(pool, worker, task)) {
+        free(task);
+        return -1;
+    }
+    return 0;
+}
+
+// lists one directory, every subdirectory becomes a task of its own. Only reads the image and the
+// fully loaded FAT cache, so any number of these run at once
+static void walk_dir(pool_t *pool, int worker, void *data, void *arg) {
+    walk_t *walk = arg;
+    walk_task_t *task = data;
+    fat32_volume_t *vol = walk->vol;
+    uint8_t *buf = walk->bufs + (size_t)worker * WALK_RUN_CLUSTERS * vol->cluster_size;
+    char *path = walk->paths + (size_t)worker * WALK_PATH_MAX;
+    uint32_t entries_per_cluster = vol->entries_per_cluster;
+
+    size_t len = strlen(task->path);
+    memcpy(path, task->path, len);
+    path[len++] = '/';
+
+    uint32_t cluster = task->cluster;
+    uint32_t visited = 0;
+    int finished = 0;
+
+    vfat_lfn_t lfn;
+    vfat_lfn_reset(&lfn);
+
+    while (!finished && cluster >= 2 && cluster < END_OF_CHAIN &&
+           !__atomic_load_n(&walk->stop, __ATOMIC_RELAXED)) {
+        // contiguous stretches of the chain are read in one go
+        uint32_t run = 1;
+        uint32_t next = read_fat_entry(vol, cluster);
+        while (run < WALK_RUN_CLUSTERS && next == cluster + run) {
+            run++;
+            next = read_fat_entry(vol, cluster + run - 1);
+        }
+
+        visited += run;
+        if (visited > vol->total_clusters || read_clusters(vol, cluster, run, buf)) {
+            walk_fail(walk);
+            break;
+        }
+
+        for (uint32_t i = 0; i < run * entries_per_cluster; i++) {
+            const fat32_dir_entry_t *raw =
+                (const fat32_dir_entry_t *)(buf + i * sizeof(fat32_dir_entry_t));
+            if (raw->name[0] == 0) {
+                finished = 1;
+                break;
+            }
+            if (is_long_name(raw) && raw->name[0] != 0xE5) {
+                vfat_lfn_feed(&lfn, (const uint8_t *)raw);
+                continue;
+            }
+            if (raw->name[0] == 0xE5 || (raw->attr & ATTR_VOLUME_ID) || is_dot_entry(raw)) {
+                vfat_lfn_reset(&lfn);
+                continue;
+            }
+
+            fat32_dirent_t entry;
+            fill_dirent(raw, &lfn, &entry);
+            vfat_lfn_reset(&lfn);
+
+            // also what ends a walk through a directory that contains one of its ancestors
+            size_t name_len = strlen(entry.name);
+            if (len + name_len >= WALK_PATH_MAX) {
+                fprintf(stderr, "path too long: %.*s\n", (int)len, path);
+                walk_fail(walk);
+                finished = 1;
+                break;
+            }
+            memcpy(path + len, entry.name, name_len + 1);
+
+            if (walk->fn(path, &entry, task->depth, walk->arg)) {
+                __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+                finished = 1;
+                break;
+            }
+
+            if ((entry.attr & ATTR_DIRECTORY) && entry.first_cluster >= 2 &&
+                walk_submit(pool, worker, entry.first_cluster, task->depth + 1, path,
+                            len + name_len)) {
+                walk_fail(walk);
+                finished = 1;
+                break;
+            }
+        }
+
+        cluster = next;
+    }
+
+    free(task);
+}
+
+static int walk_path(fat32_volume_t *vol,
+                     const char *path,
+                     int threads,
+                     fat32_walk_fn fn,
+                     void *arg) {
+    arena_reset(&vol->arena);
+
+    uint32_t dir_cluster = resolve_dir(vol, path, strlen(path));
+    if (dir_cluster == 0) {
+        fprintf(stderr, "Directory not found: %s\n", path);
+        return -1;
+    }
+
+    // the workers must never fill the cache themselves
+    if (fat_load_all(vol))
+        return -1;
+
+    walk_t walk = {0};
+    walk.vol = vol;
+    walk.fn = fn;
+    walk.arg = arg;
+
+    pool_t *pool = pool_create(threads, walk_dir, &walk);
+    if (!pool) {
+        fprintf(stderr, "failed to create thread pool\n");
+        return -1;
+    }
+
+    int workers = pool_workers(pool);
+    walk.bufs = malloc((size_t)workers * WALK_RUN_CLUSTERS * vol->cluster_size);
+    walk.paths = malloc((size_t)workers * WALK_PATH_MAX);
+
+    // children get exactly one separator appended to the start path
+    size_t len = strlen(path);
+    while (len > 0 && is_separator(path[len - 1]))
+        len--;
+
+    int ret = -1;
+    if (!walk.bufs || !walk.paths) {
+        fprintf(stderr, "failed to allocate memory\n");
+    } else if (len < WALK_PATH_MAX && walk_submit(pool, 0, dir_cluster, 0, path, len) == 0) {
+        pool_run(pool);
+        ret = walk.error ? -1 : 0;
+    }
+
+    free(walk.bufs);
+    free(walk.paths);
+    pool_destroy(pool);
+    return ret;
+}
+
+int fat32_walk(fat32_volume_t *vol, const char *path, int threads, fat32_walk_fn fn, void *arg) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = walk_path(vol, path, threads, fn, arg);
+    trace_add(vol->trace, TRACE_WALK, path, 0, 0, threads, start, ret);
+    return ret;
+}
+
+typedef struct {
+    fat32_volume_t *vol;
+    fat32_usage_t usage;
+} du_t;
+
+static int du_entry(const char *path, const fat32_dirent_t *entry, int depth, void *arg) {
+    (void)path;
+    (void)depth;
+    du_t *du = arg;
+
+    if (entry->attr & ATTR_DIRECTORY) {
+        __atomic_add_fetch(&du->usage.dirs, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&du->usage.files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&du->usage.bytes, entry->size, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&du->usage.clusters,
+                       chain_length(du->vol, entry->first_cluster),
+                       __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int du_path(fat32_volume_t *vol, const char *path, int threads, fat32_usage_t *usage) {
+    du_t du = {0};
+    du.vol = vol;
+
+    if (walk_path(vol, path, threads, du_entry, &du))
+        return -1;
+
+    // the walk reports what is below the directory, not the directory itself
+    arena_reset(&vol->arena);
+    du.usage.clusters += chain_length(vol, resolve_dir(vol, path, strlen(path)));
+    du.usage.allocated = du.usage.clusters * vol->cluster_size;
+
+    *usage = du.usage;
+    return 0;
+}
+
+int fat32_du(fat32_volume_t *vol, const char *path, int threads, fat32_usage_t *usage) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = du_path(vol, path, threads, usage);
+    trace_add(vol->trace, TRACE_DU, path, 0, 0, threads, start, ret);
+    return ret;
+}
+
+// looks up the entry named by path, returns 1 if found, 0 if not, -1 for the root directory.
+// slot is left untouched for . and .. components
+static int lookup_path(fat32_volume_t *vol,
+                       const char *path,
+                       fat32_dir_entry_t *entry,
+                       dir_slot_t *slot,
+                       dir_span_t *span) {
+    size_t parent_len;
+    const char *name;
+    size_t name_len;
+    if (!path_split(path, &parent_len, &name, &name_len))
+        return -1;
+
+    uint32_t dir_cluster = resolve_dir(vol, path, parent_len);
+    if (dir_cluster == 0)
+        return 0;
+
+    if ((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+        memset(entry, 0, sizeof(*entry));
+        entry->attr = ATTR_DIRECTORY;
+        return resolve_dir(vol, path, strlen(path)) != 0;
+    }
+
+    name_key_t key;
+    if (make_key(name, name_len, &key))
+        return 0;
+
+    return find_entry(vol, dir_cluster, &key, entry, slot, span) == 1;
+}
+
+static int stat_path(fat32_volume_t *vol, const char *path, fat32_dirent_t *entry) {
+    arena_reset(&vol->arena);
+
+    fat32_dir_entry_t raw;
+    dir_span_t span;
+    vfat_lfn_reset(&span.lfn);
+    int ret = lookup_path(vol, path, &raw, NULL, &span);
+    if (ret == 0) {
+        fprintf(stderr, "no such file or directory: %s\n", path);
+        return -1;
+    }
+
+    if (ret < 0) {
+        memset(&raw, 0, sizeof(raw));
+        memcpy(raw.name, "/          ", 11);
+        raw.attr = ATTR_DIRECTORY;
+        raw.fst_clus_hi = htole16((vol->root_cluster >> 16) & 0xFFFF);
+        raw.fst_clus_lo = htole16(vol->root_cluster & 0xFFFF);
+    }
+
+    fill_dirent(&raw, &span.lfn, entry);
+    return 0;
+}
+
+int fat32_stat(fat32_volume_t *vol, const char *path, fat32_dirent_t *entry) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = stat_path(vol, path, entry);
+    trace_add(vol->trace, TRACE_STAT, path, 0, 0, 0, start, ret);
+    return ret;
+}
+
+// finds the file a read or write refers to
+static int open_file(fat32_volume_t *vol,
+                     const char *path,
+                     fat32_dir_entry_t *entry,
+                     dir_slot_t *slot) {
+    int ret = lookup_path(vol, path, entry, slot, NULL);
+    if (ret == 0) {
+        fprintf(stderr, "no such file: %s\n", path);
+        return -1;
+    }
+    if (ret < 0 || (entry->attr & ATTR_DIRECTORY)) {
+        fprintf(stderr, "%s is a directory\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// walks a chain to its index-th cluster, returns 0 if the chain is shorter
+static uint32_t chain_cluster(fat32_volume_t *vol, uint32_t first, uint32_t index) {
+    uint32_t cluster = first;
+    for (uint32_t i = 0; i < index && cluster >= 2 && cluster < END_OF_CHAIN; i++)
+        cluster = read_fat_entry(vol, cluster);
+    return (cluster >= 2 && cluster < END_OF_CHAIN) ? cluster : 0;
+}
+
+// copies between buf and the chain starting at byte pos of cluster, a NULL buf on write fills
+// with zeros. Contiguous clusters are transferred with a single access
+static int transfer(fat32_volume_t *vol,
+                    uint32_t cluster,
+                    uint32_t pos,
+                    uint8_t *buf,
+                    size_t len,
+                    int write) {
+    while (len > 0) {
+        if (cluster < 2 || cluster >= END_OF_CHAIN) {
+            fprintf(stderr, "file chain is shorter than its size\n");
+            return -1;
+        }
+
+        size_t chunk = vol->cluster_size - pos;
+        uint32_t last = cluster;
+        uint32_t next = read_fat_entry(vol, last);
+        while (chunk < len && next == last + 1) {
+            last = next;
+            next = read_fat_entry(vol, last);
+            chunk += vol->cluster_size;
+        }
+        if (chunk > len)
+            chunk = len;
+
+        off_t offset = cluster_offset(vol, cluster) + pos;
+        int ret;
+        if (!write) {
+            ret = vol_read(vol, offset, buf, chunk);
+        } else if (buf) {
+            ret = vol_write(vol, offset, buf, chunk);
+        } else {
+            size_t mark = vol->arena.used;
+            uint8_t *zero = arena_alloc(&vol->arena, vol->cluster_size);
+            if (!zero)
+                return -1;
+
+            memset(zero, 0, vol->cluster_size);
+            ret = 0;
+            for (size_t done = 0; done < chunk && ret == 0;) {
+                size_t piece = chunk - done < vol->cluster_size ? chunk - done : vol->cluster_size;
+                ret = vol_write(vol, offset + done, zero, piece);
+                done += piece;
+            }
+            vol->arena.used = mark;
+        }
+        if (ret) {
+            fprintf(stderr, "failed to %s file data\n", write ? "write" : "read");
+            return -1;
+        }
+
+        if (buf)
+            buf += chunk;
+        len -= chunk;
+        pos = 0;
+        cluster = next;
+    }
+
+    return 0;
+}
+
+// lengths past the 32-bit count field are recorded saturated
+static uint32_t trace_count(size_t len) {
+    return len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+}
+
+static int64_t read_file(fat32_volume_t *vol,
+                         const char *path,
+                         uint64_t offset,
+                         void *buf,
+                         size_t len) {
+    arena_reset(&vol->arena);
+
+    fat32_dir_entry_t entry;
+    if (open_file(vol, path, &entry, NULL))
+        return -1;
+
+    uint32_t size = le32toh(entry.file_size);
+    if (offset >= size)
+        return 0;
+    if (len > size - offset)
+        len = size - offset;
+
+    uint32_t cluster = chain_cluster(vol, entry_cluster(&entry), offset >> vol->cluster_shift);
+    if (transfer(vol, cluster, offset & vol->cluster_mask, buf, len, 0))
+        return -1;
+
+    return len;
+}
+
+int64_t fat32_read(fat32_volume_t *vol, const char *path, uint64_t offset, void *buf, size_t len) {
+    uint64_t start = trace_start(vol->trace);
+    int64_t ret = read_file(vol, path, offset, buf, len);
+    trace_add(vol->trace, TRACE_READ, path, 0, offset, trace_count(len), start, ret);
+    return ret;
+}
+
+// gives back what extend_chain added: everything after tail, or the whole chain from first when
+// the chain was new (tail 0)
+static void shrink_chain(fat32_volume_t *vol, uint32_t first, uint32_t tail) {
+    if (tail == 0) {
+        if (first)
+            free_chain(vol, first);
+        return;
+    }
+
+    uint32_t next = read_fat_entry(vol, tail);
+    write_fat_entry(vol, tail, 0x0FFFFFFF);
+    if (next >= 2 && next < END_OF_CHAIN)
+        free_chain(vol, next);
+}
+
+// grows a chain to count clusters, each new cluster allocated right after the previous one
+// where possible and a new chain near goal. tail is set to the last cluster before the growth, 0
+// for a new chain. Returns the first cluster, or 0 on failure with nothing allocated
+static uint32_t extend_chain(fat32_volume_t *vol,
+                             uint32_t first,
+                             uint32_t count,
+                             uint32_t goal,
+                             uint32_t *tail) {
+    uint32_t have = 0;
+    uint32_t last = 0;
+
+    for (uint32_t cluster = first; cluster >= 2 && cluster < END_OF_CHAIN;
+         cluster = read_fat_entry(vol, cluster)) {
+        last = cluster;
+        have++;
+    }
+    *tail = last;
+
+    while (have < count) {
+        uint32_t cluster = alloc_cluster(vol, last ? last + 1 : goal);
+        if (cluster == 0) {
+            fprintf(stderr, "no free clusters available\n");
+            shrink_chain(vol, first, *tail);
+            return 0;
+        }
+
+        if (last)
+            write_fat_entry(vol, last, cluster);
+        else
+            first = cluster;
+
+        last = cluster;
+        have++;
+    }
+
+    return first;
+}
+
+static int64_t write_file(fat32_volume_t *vol,
+                          const char *path,
+                          uint64_t offset,
+                          const void *buf,
+                          size_t len) {
+    arena_reset(&vol->arena);
+
+    fat32_dir_entry_t entry;
+    dir_slot_t slot;
+    if (open_file(vol, path, &entry, &slot))
+        return -1;
+
+    uint32_t size = le32toh(entry.file_size);
+    uint64_t end = offset + len;
+    if (end > 0xFFFFFFFF) {
+        fprintf(stderr, "file would exceed 4 GiB\n");
+        return -1;
+    }
+
+    uint32_t first = entry_cluster(&entry);
+    uint32_t tail = 0;
+    int grown = 0;
+    if (end > size) {
+        uint32_t clusters = (end + vol->cluster_mask) >> vol->cluster_shift;
+        // the data of an empty file goes near its parent directory
+        uint32_t goal = first;
+        size_t parent_len;
+        const char *name;
+        size_t name_len;
+        if (goal == 0 && path_split(path, &parent_len, &name, &name_len))
+            goal = resolve_dir(vol, path, parent_len);
+        first = extend_chain(vol, first, clusters, goal, &tail);
+        grown = 1;
+        if (first == 0) {
+            commit_op(vol);
+            return -1;
+        }
+    }
+
+    int ret = 0;
+    if (offset > size) {
+        // the gap between the old end and the write reads back as zeros
+        uint32_t cluster = chain_cluster(vol, first, size >> vol->cluster_shift);
+        ret = transfer(vol, cluster, size & vol->cluster_mask, NULL, offset - size, 1);
+    }
+
+    if (ret == 0 && len > 0) {
+        uint32_t cluster = chain_cluster(vol, first, offset >> vol->cluster_shift);
+        ret = transfer(vol, cluster, offset & vol->cluster_mask, (uint8_t *)buf, len, 1);
+    }
+
+    if (ret == 0) {
+        if (end > size)
+            entry.file_size = htole32((uint32_t)end);
+        entry.fst_clus_hi = htole16((first >> 16) & 0xFFFF);
+        entry.fst_clus_lo = htole16(first & 0xFFFF);
+        entry.wrt_date = entry.lst_acc_date = htole16(get_fat_date());
+        entry.wrt_time = htole16(get_fat_time());
+        ret = write_dir_entry(vol, &slot, &entry);
+    }
+
+    // clusters the entry does not reach would be lost once committed
+    if (ret && grown)
+        shrink_chain(vol, first, tail);
+
+    if (commit_op(vol) || ret)
+        return -1;
+
+    return len;
+}
+
+int64_t fat32_write(fat32_volume_t *vol,
+                    const char *path,
+                    uint64_t offset,
+                    const void *buf,
+                    size_t len) {
+    uint64_t start = trace_start(vol->trace);
+    int64_t ret = write_file(vol, path, offset, buf, len);
+    trace_add(vol->trace, TRACE_WRITE, path, 0, offset, trace_count(len), start, ret);
+    return ret;
+}
+
+void fat32_begin_batch(fat32_volume_t *vol) {
+    vol->batch_depth++;
+    trace_add(vol->trace, TRACE_BEGIN_BATCH, NULL, 0, 0, 0, trace_start(vol->trace), 0);
+}
+
+int fat32_end_batch(fat32_volume_t *vol) {
+    uint64_t start = trace_start(vol->trace);
+    if (vol->batch_depth > 0)
+        vol->batch_depth--;
+    int ret = commit_op(vol);
+    trace_add(vol->trace, TRACE_END_BATCH, NULL, 0, 0, 0, start, ret);
+    return ret;
+}
+
+int fat32_trace(fat32_volume_t *vol, const char *trace_path) {
+    int ret = trace_close(vol->trace);
+    vol->trace = NULL;
+
+    if (trace_path) {
+        vol->trace = trace_create(trace_path);
+        if (!vol->trace)
+            return -1;
+    }
+    return ret;
+}
+
+static int is_directory(fat32_volume_t *vol, const char *path) {
+    arena_reset(&vol->arena);
+
+    fat32_dir_entry_t entry;
+    int ret = lookup_path(vol, path, &entry, NULL, NULL);
+    if (ret < 0)
+        return 1;
+
+    return ret && (entry.attr & ATTR_DIRECTORY);
+}
+
+int fat32_is_directory(fat32_volume_t *vol, const char *path) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = is_directory(vol, path);
+    trace_add(vol->trace, TRACE_IS_DIRECTORY, path, 0, 0, 0, start, ret);
+    return ret;
+}
+
+static int path_exists(fat32_volume_t *vol, const char *path) {
+    arena_reset(&vol->arena);
+
+    fat32_dir_entry_t entry;
+    return lookup_path(vol, path, &entry, NULL, NULL) != 0;
+}
+
+int fat32_exists(fat32_volume_t *vol, const char *path) {
+    uint64_t start = trace_start(vol->trace);
+    int ret = path_exists(vol, path);
+    trace_add(vol->trace, TRACE_EXISTS, path, 0, 0, 0, start, ret);
+    return ret;
+}
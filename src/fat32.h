@@ -1,11 +1,122 @@
 #ifndef FAT32_FAT32_H
 #define FAT32_FAT32_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct fat32_volume fat32_volume_t;
+typedef struct fat32_dir fat32_dir_t;
+
+// UTF-8 bytes of the longest long name
+#define FAT32_NAME_MAX 765
+
+typedef struct {
+    char name[FAT32_NAME_MAX + 1];
+    uint8_t attr;
+    uint32_t size;
+    uint32_t first_cluster;
+    uint16_t crt_date;
+    uint16_t crt_time;
+    uint16_t wrt_date;
+    uint16_t wrt_time;
+    uint16_t acc_date;
+} fat32_dirent_t;
+
+typedef struct {
+    uint32_t chains;
+    uint32_t fragmented;
+    uint32_t clusters;
+    // links from a cluster to anything but the cluster right after it
+    uint32_t breaks;
+} fat32_frag_stats_t;
+
+typedef struct {
+    uint64_t files;
+    uint64_t dirs;
+    // sum of the file sizes
+    uint64_t bytes;
+    // clusters held by the files and directories, the walked directory included
+    uint64_t clusters;
+    uint64_t allocated;
+} fat32_usage_t;
+
+// gets the full path of the entry and its depth below the walked directory, returning non-zero
+// stops the walk. Called from several threads at once
+typedef int (*fat32_walk_fn)(const char *path, const fat32_dirent_t *entry, int depth, void *arg);
+
+#define FAT32_ATTR_DIRECTORY 0x10
+
+// lowest free cluster
+#define FAT32_ALLOC_FIRST_FIT 0
+// first free cluster after the FSInfo nxt_free hint
+#define FAT32_ALLOC_NEXT_FIT 1
+// first free cluster after a goal: the parent for new directories, the last cluster for appends
+#define FAT32_ALLOC_GOAL 2
+
 int create_fat32_file(const char *filepath);
-int fat32_mkdir(const char *filesystem_path, const char *path);
-int fat32_touch(const char *filesystem_path, const char *path);
-int fat32_ls(const char *filesystem_path, const char *path);
-int fat32_is_directory(const char *filesystem_path, const char *path);
-int fat32_exists(const char *filesystem_path, const char *path);
+
+// opens the image once, every other call operates on the returned volume
+fat32_volume_t *fat32_mount(const char *filesystem_path);
+// mounts base_path read-only, every change goes to delta_path which is created if missing
+fat32_volume_t *fat32_mount_overlay(const char *base_path, const char *delta_path);
+void fat32_unmount(fat32_volume_t *vol);
+// FAT32_ALLOC_GOAL unless changed
+void fat32_set_alloc_policy(fat32_volume_t *vol, int policy);
+
+int fat32_mkdir(fat32_volume_t *vol, const char *path);
+int fat32_touch(fat32_volume_t *vol, const char *path);
+// removes a file, or with recursive set a file or a whole directory tree
+int fat32_rm(fat32_volume_t *vol, const char *path, int recursive);
+// removes an empty directory
+int fat32_rmdir(fat32_volume_t *vol, const char *path);
+// packs the live entries of a directory and frees its unused trailing clusters, returns the
+// number of deleted entries dropped
+int fat32_compact(fat32_volume_t *vol, const char *path);
+// makes every chain contiguous, directories first in walk order, reports fragmentation around it
+int fat32_defrag(fat32_volume_t *vol, fat32_frag_stats_t *before, fat32_frag_stats_t *after);
+// writes the volume as a standalone image, resolving the overlay if there is one
+int fat32_flatten(fat32_volume_t *vol, const char *output_path);
+// starts tracking changes under name, or restarts an existing checkpoint. The dirty map is kept in
+// <image>.<name>.ckpt and picked up again by later mounts
+int fat32_checkpoint(fat32_volume_t *vol, const char *name);
+// writes every range changed since the checkpoint to output_path, with advance set the checkpoint
+// then restarts. Returns the number of image bytes written
+int64_t fat32_diff(fat32_volume_t *vol, const char *name, const char *output_path, int advance);
+// applies a diff to a copy of the image it was taken from
+int fat32_apply_diff(const char *diff_path, const char *image_path);
+// punches every free cluster out of the host file, returns the number of clusters punched
+int64_t fat32_trim(fat32_volume_t *vol);
+// visits everything below path except . and .., every directory is a task on a work-stealing pool
+// of threads workers, one per CPU if threads <= 0. Nothing may modify the volume meanwhile
+int fat32_walk(fat32_volume_t *vol, const char *path, int threads, fat32_walk_fn fn, void *arg);
+int fat32_du(fat32_volume_t *vol, const char *path, int threads, fat32_usage_t *usage);
+int fat32_stat(fat32_volume_t *vol, const char *path, fat32_dirent_t *entry);
+// return the number of bytes transferred or -1, reads stop at the end of the file and writes past
+// it extend the file, filling any gap with zeros
+int64_t fat32_read(fat32_volume_t *vol, const char *path, uint64_t offset, void *buf, size_t len);
+int64_t fat32_write(fat32_volume_t *vol,
+                    const char *path,
+                    uint64_t offset,
+                    const void *buf,
+                    size_t len);
+
+// records every following call with its arguments, result and timing to trace_path, replacing
+// any recording in progress. NULL stops recording
+int fat32_trace(fat32_volume_t *vol, const char *trace_path);
+
+// operations inside a batch share a single write back at fat32_end_batch. FAT sectors still go
+// out ahead of any directory entry that refers to them, so a process killed inside a batch can
+// leak clusters but never leaves an entry pointing at a free one
+void fat32_begin_batch(fat32_volume_t *vol);
+int fat32_end_batch(fat32_volume_t *vol);
+
+int fat32_is_directory(fat32_volume_t *vol, const char *path);
+int fat32_exists(fat32_volume_t *vol, const char *path);
+
+// returns NULL if the directory could not be opened
+fat32_dir_t *fat32_opendir(fat32_volume_t *vol, const char *path);
+// returns 1 if an entry was read, 0 at the end of the directory, -1 on error
+int fat32_readdir(fat32_dir_t *dir, fat32_dirent_t *entry);
+void fat32_closedir(fat32_dir_t *dir);
 
 #endif
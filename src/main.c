@@ -1,16 +1,75 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "fat32.h"
+#include "replay.h"
+#include "server.h"
 #include "shell.h"
 
+#define USAGE "Usage: fat32 [--serve SOCKET] [--trace TRACE] FILE [DELTA]\n" \
+              "       fat32 --replay TRACE FILE\n"
+
+static int serve(const char *socket_path,
+                 const char *filepath,
+                 const char *delta_path,
+                 const char *trace_path) {
+    fat32_volume_t *vol = delta_path ? fat32_mount_overlay(filepath, delta_path)
+                                     : fat32_mount(filepath);
+    if (!vol) {
+        fprintf(stderr, "failed to mount %s\n", filepath);
+        return -1;
+    }
+
+    if (trace_path && fat32_trace(vol, trace_path)) {
+        fat32_unmount(vol);
+        return -1;
+    }
+
+    int ret = fat32_serve(vol, socket_path);
+    fat32_unmount(vol);
+    return ret;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        printf("Invalid agruments count\n Usage: fat32 FILE\n");
+    const char *socket_path = NULL;
+    const char *trace_path = NULL;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (argc < 3) {
+            printf(USAGE);
+            return 0;
+        }
+
+        if (strcmp(argv[1], "--serve") == 0) {
+            socket_path = argv[2];
+        } else if (strcmp(argv[1], "--trace") == 0) {
+            trace_path = argv[2];
+        } else if (strcmp(argv[1], "--replay") == 0) {
+            if (argc != 4) {
+                printf(USAGE);
+                return 0;
+            }
+            return fat32_replay(argv[2], argv[3]) ? -1 : 0;
+        } else {
+            printf("unknown option %s\n" USAGE, argv[1]);
+            return 0;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc != 2 && argc != 3) {
+        printf("Invalid agruments count\n" USAGE);
         return 0;
     }
 
     const char *filepath = argv[1];
+    const char *delta_path = argc == 3 ? argv[2] : NULL;
+
+    if (delta_path && access(filepath, F_OK) != 0) {
+        fprintf(stderr, "base image %s does not exist\n", filepath);
+        return -1;
+    }
 
     if (access(filepath, F_OK) != 0) {
         int ret = create_fat32_file(filepath);
@@ -20,5 +79,8 @@ int main(int argc, char **argv) {
         }
     }
 
-    return lauch_shell(filepath);
+    if (socket_path)
+        return serve(socket_path, filepath, delta_path, trace_path);
+
+    return lauch_shell(filepath, delta_path, trace_path);
 }
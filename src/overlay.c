@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+#include "overlay.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#define OVERLAY_MAGIC "FAT32OVL"
+// version 1 deltas have no grid_offset, their grid starts at offset 0
+#define OVERLAY_VERSION 2
+#define OVERLAY_TABLE_OFFSET 4096
+
+typedef struct {
+    uint8_t magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t base_size;
+    uint32_t block_count;
+    uint32_t slot_count;
+    uint64_t grid_offset;
+} __attribute__((packed)) overlay_header_t;
+
+struct overlay {
+    FILE *base;
+    FILE *delta;
+    uint32_t block_size;
+    // block sizes are powers of two, offsets are split with these
+    uint8_t block_shift;
+    uint32_t block_mask;
+    // block boundaries fall on grid_offset, the base is shifted by grid_pad so block 0 holds
+    // only the tail of the first partial block
+    uint64_t grid_offset;
+    uint32_t grid_pad;
+    uint32_t block_count;
+    uint32_t slot_count;
+    off_t data_offset;
+    // block -> slot in the delta, 0 while the block still comes from the base
+    uint32_t *table;
+    uint8_t *block_buf;
+};
+
+static off_t slot_offset(overlay_t *ov, uint32_t slot) {
+    return ov->data_offset + ((off_t)(slot - 1) << ov->block_shift);
+}
+
+static int set_block_size(overlay_t *ov, uint32_t block_size) {
+    if (block_size == 0 || (block_size & (block_size - 1)) != 0)
+        return -1;
+
+    ov->block_size = block_size;
+    ov->block_shift = 0;
+    while ((1u << ov->block_shift) < block_size)
+        ov->block_shift++;
+    ov->block_mask = block_size - 1;
+    return 0;
+}
+
+static void set_grid(overlay_t *ov, uint64_t grid_offset) {
+    ov->grid_offset = grid_offset;
+    ov->grid_pad = (ov->block_size - (grid_offset & ov->block_mask)) & ov->block_mask;
+}
+
+// positional I/O keeps no shared file position, so reads may run from several threads
+static int read_at(FILE *file, off_t offset, void *buf, size_t len) {
+    uint8_t *dest = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fileno(file), dest, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        dest += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_at(FILE *file, off_t offset, const void *buf, size_t len) {
+    const uint8_t *src = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fileno(file), src, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        src += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_header(overlay_t *ov, uint64_t base_size) {
+    overlay_header_t header = {0};
+    memcpy(header.magic, OVERLAY_MAGIC, 8);
+    header.version = htole32(OVERLAY_VERSION);
+    header.block_size = htole32(ov->block_size);
+    header.base_size = htole64(base_size);
+    header.block_count = htole32(ov->block_count);
+    header.slot_count = htole32(ov->slot_count);
+    header.grid_offset = htole64(ov->grid_offset);
+
+    return write_at(ov->delta, 0, &header, sizeof(header));
+}
+
+static int create_delta(overlay_t *ov, const char *delta_path, uint64_t base_size) {
+    ov->delta = fopen(delta_path, "w+b");
+    if (!ov->delta) {
+        fprintf(stderr, "failed to create overlay %s\n", delta_path);
+        return -1;
+    }
+
+    ov->block_count = (base_size + ov->grid_pad + ov->block_mask) >> ov->block_shift;
+    ov->slot_count = 0;
+    if (write_header(ov, base_size)) {
+        fprintf(stderr, "failed to write overlay %s\n", delta_path);
+        unlink(delta_path);
+        return -1;
+    }
+
+    // the table starts out all zero, leave it as a hole
+    off_t table_end = OVERLAY_TABLE_OFFSET + (off_t)ov->block_count * sizeof(uint32_t);
+    if (fflush(ov->delta) || ftruncate(fileno(ov->delta), table_end)) {
+        fprintf(stderr, "failed to size overlay %s\n", delta_path);
+        unlink(delta_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int load_delta(overlay_t *ov, const char *delta_path, uint64_t base_size) {
+    overlay_header_t header;
+    if (read_at(ov->delta, 0, &header, sizeof(header)) ||
+        memcmp(header.magic, OVERLAY_MAGIC, 8) != 0 ||
+        le32toh(header.version) == 0 || le32toh(header.version) > OVERLAY_VERSION) {
+        fprintf(stderr, "%s is not an overlay\n", delta_path);
+        return -1;
+    }
+
+    if (le64toh(header.base_size) != base_size) {
+        fprintf(stderr, "overlay %s was made for a different base image\n", delta_path);
+        return -1;
+    }
+
+    ov->block_count = le32toh(header.block_count);
+    ov->slot_count = le32toh(header.slot_count);
+
+    int ret = set_block_size(ov, le32toh(header.block_size));
+    if (ret == 0)
+        set_grid(ov, le32toh(header.version) > 1 ? le64toh(header.grid_offset) : 0);
+    if (ret || ((uint64_t)ov->block_count << ov->block_shift) < base_size + ov->grid_pad) {
+        fprintf(stderr, "overlay %s has an invalid header\n", delta_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+overlay_t *overlay_open(FILE *base,
+                        const char *delta_path,
+                        uint32_t block_size,
+                        uint64_t grid_offset) {
+    overlay_t *ov = calloc(1, sizeof(overlay_t));
+    if (!ov) {
+        fprintf(stderr, "failed to allocate memory\n");
+        fclose(base);
+        return NULL;
+    }
+
+    ov->base = base;
+    if (set_block_size(ov, block_size)) {
+        fprintf(stderr, "unsupported overlay block size %u\n", block_size);
+        overlay_close(ov);
+        return NULL;
+    }
+    set_grid(ov, grid_offset);
+
+    if (fseeko(base, 0, SEEK_END)) {
+        fprintf(stderr, "failed to size base image\n");
+        overlay_close(ov);
+        return NULL;
+    }
+    uint64_t base_size = ftello(base);
+
+    ov->delta = fopen(delta_path, "r+b");
+    int ret = ov->delta ? load_delta(ov, delta_path, base_size)
+                        : create_delta(ov, delta_path, base_size);
+    if (ret) {
+        overlay_close(ov);
+        return NULL;
+    }
+
+    if (flock(fileno(ov->delta), LOCK_EX | LOCK_NB)) {
+        fprintf(stderr, "%s is mounted by another process\n", delta_path);
+        overlay_close(ov);
+        return NULL;
+    }
+
+    size_t table_size = (size_t)ov->block_count * sizeof(uint32_t);
+    off_t table_end = OVERLAY_TABLE_OFFSET + table_size;
+    ov->data_offset = (table_end + ov->block_mask) & ~(off_t)ov->block_mask;
+
+    ov->table = malloc(table_size);
+    ov->block_buf = malloc(ov->block_size);
+    if (!ov->table || !ov->block_buf) {
+        fprintf(stderr, "failed to allocate memory\n");
+        overlay_close(ov);
+        return NULL;
+    }
+
+    if (read_at(ov->delta, OVERLAY_TABLE_OFFSET, ov->table, table_size)) {
+        fprintf(stderr, "failed to read overlay remap table\n");
+        overlay_close(ov);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < ov->block_count; i++)
+        ov->table[i] = le32toh(ov->table[i]);
+
+    return ov;
+}
+
+void overlay_close(overlay_t *ov) {
+    if (!ov)
+        return;
+
+    if (ov->delta)
+        fclose(ov->delta);
+    fclose(ov->base);
+    free(ov->table);
+    free(ov->block_buf);
+    free(ov);
+}
+
+int overlay_read(overlay_t *ov, off_t offset, void *buf, size_t len) {
+    uint8_t *dest = buf;
+
+    while (len > 0) {
+        uint64_t pos = offset + ov->grid_pad;
+        uint32_t block = pos >> ov->block_shift;
+        uint32_t in_block = pos & ov->block_mask;
+        if (block >= ov->block_count)
+            return -1;
+
+        // extend the read over following blocks that are laid out contiguously in the same file,
+        // so large reads stay large
+        uint32_t slot = ov->table[block];
+        size_t chunk = ov->block_size - in_block;
+        uint32_t next = block + 1;
+        while (chunk < len && next < ov->block_count &&
+               ov->table[next] == (slot ? slot + (next - block) : 0)) {
+            chunk += ov->block_size;
+            next++;
+        }
+        if (chunk > len)
+            chunk = len;
+
+        int ret = slot ? read_at(ov->delta, slot_offset(ov, slot) + in_block, dest, chunk)
+                       : read_at(ov->base, offset, dest, chunk);
+        if (ret)
+            return -1;
+
+        dest += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+// gives a block a slot in the delta holding data, or its current contents from the base when data
+// is NULL
+static uint32_t map_block(overlay_t *ov, uint32_t block, const void *data) {
+    uint32_t slot = ov->slot_count + 1;
+
+    if (!data) {
+        // the first block starts grid_pad bytes in, the last one may be partial
+        memset(ov->block_buf, 0, ov->block_size);
+        uint32_t skip = block == 0 ? ov->grid_pad : 0;
+        off_t base_offset = ((off_t)block << ov->block_shift) + skip - ov->grid_pad;
+        if (pread(fileno(ov->base), ov->block_buf + skip, ov->block_size - skip, base_offset) < 0)
+            return 0;
+        data = ov->block_buf;
+    }
+
+    if (write_at(ov->delta, slot_offset(ov, slot), data, ov->block_size))
+        return 0;
+
+    // data first, then the table entry and the slot count, so a torn update only leaks a slot
+    uint32_t entry = htole32(slot);
+    if (write_at(ov->delta, OVERLAY_TABLE_OFFSET + (off_t)block * sizeof(uint32_t), &entry, 4))
+        return 0;
+
+    ov->table[block] = slot;
+    ov->slot_count = slot;
+
+    uint32_t slot_count = htole32(ov->slot_count);
+    if (write_at(ov->delta, offsetof(overlay_header_t, slot_count), &slot_count, 4))
+        return 0;
+
+    return slot;
+}
+
+int overlay_write(overlay_t *ov, off_t offset, const void *buf, size_t len) {
+    const uint8_t *src = buf;
+
+    while (len > 0) {
+        uint64_t pos = offset + ov->grid_pad;
+        uint32_t block = pos >> ov->block_shift;
+        uint32_t in_block = pos & ov->block_mask;
+        size_t chunk = ov->block_size - in_block;
+        if (chunk > len)
+            chunk = len;
+        if (block >= ov->block_count)
+            return -1;
+
+        // a new block written whole is stored straight from src, the base is not read
+        uint32_t slot = ov->table[block];
+        int whole = !slot && chunk == ov->block_size;
+        if (!slot) {
+            slot = map_block(ov, block, whole ? src : NULL);
+            if (!slot) {
+                fprintf(stderr, "failed to copy block %u into the overlay\n", block);
+                return -1;
+            }
+        }
+
+        if (!whole && write_at(ov->delta, slot_offset(ov, slot) + in_block, src, chunk))
+            return -1;
+
+        src += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+int overlay_flush(overlay_t *ov) {
+    return fflush(ov->delta);
+}
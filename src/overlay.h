@@ -0,0 +1,25 @@
+#ifndef FAT32_OVERLAY_H
+#define FAT32_OVERLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// copy-on-write view of a read-only base image. The image is split into blocks, a block that has
+// been written lives in the delta file and the remap table in the delta header says where
+typedef struct overlay overlay_t;
+
+// creates the delta file if it does not exist yet, block_size and grid_offset are only used when
+// creating it. Block boundaries are laid so one falls on grid_offset, the area before it starts
+// with a partial block. Takes ownership of base
+overlay_t *overlay_open(FILE *base,
+                        const char *delta_path,
+                        uint32_t block_size,
+                        uint64_t grid_offset);
+void overlay_close(overlay_t *ov);
+
+int overlay_read(overlay_t *ov, off_t offset, void *buf, size_t len);
+int overlay_write(overlay_t *ov, off_t offset, const void *buf, size_t len);
+int overlay_flush(overlay_t *ov);
+
+#endif
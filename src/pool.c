@@ -0,0 +1,213 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define POOL_MAX_WORKERS 64
+
+// each worker owns a deque, it pushes and pops at the tail and idle workers steal from the head,
+// so the owner keeps working depth first on what it just produced while thieves take the oldest
+// and usually biggest subtrees
+typedef struct {
+    pthread_mutex_t lock;
+    void **tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} deque_t;
+
+struct pool {
+    pool_task_fn fn;
+    void *arg;
+    int workers;
+    deque_t *deques;
+    // submitted tasks that have not finished yet
+    size_t pending;
+    // idle workers sleep on idle_cond until submitted moves or pending drops to zero
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int idle;
+    size_t submitted;
+    pthread_t *threads;
+};
+
+typedef struct {
+    pool_t *pool;
+    int worker;
+} worker_arg_t;
+
+pool_t *pool_create(int workers, pool_task_fn fn, void *arg) {
+    if (workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+    if (workers > POOL_MAX_WORKERS)
+        workers = POOL_MAX_WORKERS;
+
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    if (!pool)
+        return NULL;
+
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->workers = workers;
+    pool->deques = calloc(workers, sizeof(deque_t));
+    pool->threads = calloc(workers, sizeof(pthread_t));
+    if (!pool->deques || !pool->threads) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < workers; i++)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    return pool;
+}
+
+void pool_destroy(pool_t *pool) {
+    if (!pool)
+        return;
+
+    for (int i = 0; i < pool->workers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+int pool_workers(pool_t *pool) {
+    return pool->workers;
+}
+
+int pool_submit(pool_t *pool, int worker, void *task) {
+    deque_t *deque = &pool->deques[worker];
+
+    pthread_mutex_lock(&deque->lock);
+    // steals leave a gap at the front, reuse it before growing
+    if (deque->tail == deque->capacity && deque->head > 0) {
+        memmove(deque->tasks,
+                deque->tasks + deque->head,
+                (deque->tail - deque->head) * sizeof(void *));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if (deque->tail == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        void **tmp = realloc(deque->tasks, capacity * sizeof(void *));
+        if (!tmp) {
+            pthread_mutex_unlock(&deque->lock);
+            fprintf(stderr, "failed to allocate memory\n");
+            return -1;
+        }
+        deque->tasks = tmp;
+        deque->capacity = capacity;
+    }
+    deque->tasks[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->submitted, 1, __ATOMIC_SEQ_CST);
+
+    // a worker counts itself idle before it checks submitted, so either it sees this task or
+    // this sees it and wakes it
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return 0;
+}
+
+static void *pop_task(deque_t *deque) {
+    void *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        task = deque->tasks[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static void *steal_task(deque_t *deque) {
+    void *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        task = deque->tasks[deque->head++];
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static void work(pool_t *pool, int worker) {
+    while (1) {
+        // read before looking, anything submitted after this moves it
+        size_t seen = __atomic_load_n(&pool->submitted, __ATOMIC_SEQ_CST);
+        void *task = pop_task(&pool->deques[worker]);
+
+        for (int i = 1; !task && i < pool->workers; i++)
+            task = steal_task(&pool->deques[(worker + i) % pool->workers]);
+
+        if (task) {
+            pool->fn(pool, worker, task, pool->arg);
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+
+        // tasks in flight elsewhere may still produce work, nothing in flight means nothing ever
+        // will
+        pthread_mutex_lock(&pool->idle_lock);
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) != 0 &&
+               __atomic_load_n(&pool->submitted, __ATOMIC_SEQ_CST) == seen)
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        int done = __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (done)
+            return;
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_arg_t *warg = arg;
+    work(warg->pool, warg->worker);
+    return NULL;
+}
+
+int pool_run(pool_t *pool) {
+    worker_arg_t args[POOL_MAX_WORKERS];
+    int started = 1;
+
+    for (; started < pool->workers; started++) {
+        args[started].pool = pool;
+        args[started].worker = started;
+        if (pthread_create(&pool->threads[started], NULL, worker_main, &args[started])) {
+            fprintf(stderr, "failed to start worker thread\n");
+            break;
+        }
+    }
+
+    // workers that failed to start leave their deque to be stolen from
+    work(pool, 0);
+
+    for (int i = 1; i < started; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    return 0;
+}
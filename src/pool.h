@@ -0,0 +1,19 @@
+#ifndef FAT32_POOL_H
+#define FAT32_POOL_H
+
+typedef struct pool pool_t;
+
+// runs one task on the given worker, the handler may submit further tasks from inside it
+typedef void (*pool_task_fn)(pool_t *pool, int worker, void *task, void *arg);
+
+// workers <= 0 picks one per online CPU
+pool_t *pool_create(int workers, pool_task_fn fn, void *arg);
+void pool_destroy(pool_t *pool);
+int pool_workers(pool_t *pool);
+// queues a task on a worker's own deque, pass worker 0 before pool_run
+int pool_submit(pool_t *pool, int worker, void *task);
+// runs until every submitted task and every task they submitted is done. The calling thread
+// takes part as worker 0
+int pool_run(pool_t *pool);
+
+#endif
@@ -0,0 +1,376 @@
+#include "replay.h"
+
+#include "fat32.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define REPLAY_COPY_CHUNK (1024 * 1024)
+#define REPLAY_FILL 0xA5
+// a volume keeps no more checkpoints than this
+#define REPLAY_MAX_CHECKPOINTS 8
+#define REPLAY_CHECKPOINT_NAME_MAX 32
+
+typedef struct {
+    uint64_t *samples;
+    size_t count;
+    size_t capacity;
+    uint64_t *recorded;
+    uint64_t bytes;
+    uint32_t errors;
+    // calls whose success or failure differs from the recording
+    uint32_t diverged;
+} op_stats_t;
+
+typedef struct {
+    fat32_volume_t *vol;
+    const char *copy_path;
+    // where replayed diffs and flattened images go, removed afterwards
+    char scratch_path[PATH_MAX];
+    // checkpoints created on the copy, their dirty maps are removed afterwards
+    char checkpoints[REPLAY_MAX_CHECKPOINTS][REPLAY_CHECKPOINT_NAME_MAX + 1];
+    int checkpoint_count;
+    uint8_t *buf;
+    size_t buf_size;
+    op_stats_t ops[TRACE_OP_COUNT];
+} replay_t;
+
+// copies the image to a new file next to it, skipping the holes of sparse images
+static int copy_image(const char *image_path, char *copy_path, size_t copy_size) {
+    if ((size_t)snprintf(copy_path, copy_size, "%s.replay.XXXXXX", image_path) >= copy_size) {
+        fprintf(stderr, "path is too long\n");
+        return -1;
+    }
+
+    int in = open(image_path, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "failed to open %s\n", image_path);
+        return -1;
+    }
+
+    int out = mkstemp(copy_path);
+    if (out < 0) {
+        fprintf(stderr, "failed to create a copy of %s\n", image_path);
+        close(in);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(REPLAY_COPY_CHUNK);
+    int ret = buf ? 0 : -1;
+    off_t offset = 0;
+
+    while (ret == 0) {
+        ssize_t got = read(in, buf, REPLAY_COPY_CHUNK);
+        if (got <= 0) {
+            ret = got < 0 ? -1 : 0;
+            break;
+        }
+
+        ssize_t zero = 0;
+        while (zero < got && buf[zero] == 0)
+            zero++;
+        if (zero < got && pwrite(out, buf, got, offset) != got)
+            ret = -1;
+        offset += got;
+    }
+
+    if (ret == 0 && ftruncate(out, offset))
+        ret = -1;
+    if (ret)
+        fprintf(stderr, "failed to copy %s\n", image_path);
+
+    free(buf);
+    close(in);
+    if (close(out) && ret == 0)
+        ret = -1;
+    if (ret)
+        unlink(copy_path);
+    return ret;
+}
+
+static int add_sample(op_stats_t *stats, uint64_t duration, uint64_t recorded) {
+    if (stats->count == stats->capacity) {
+        size_t capacity = stats->capacity ? stats->capacity * 2 : 256;
+        uint64_t *samples = realloc(stats->samples, capacity * sizeof(uint64_t));
+        if (!samples)
+            return -1;
+        stats->samples = samples;
+
+        uint64_t *rec = realloc(stats->recorded, capacity * sizeof(uint64_t));
+        if (!rec)
+            return -1;
+        stats->recorded = rec;
+        stats->capacity = capacity;
+    }
+
+    stats->samples[stats->count] = duration;
+    stats->recorded[stats->count] = recorded;
+    stats->count++;
+    return 0;
+}
+
+static uint8_t *reserve_buf(replay_t *replay, size_t len) {
+    if (len <= replay->buf_size)
+        return replay->buf;
+
+    uint8_t *buf = realloc(replay->buf, len);
+    if (!buf) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return NULL;
+    }
+
+    memset(buf + replay->buf_size, REPLAY_FILL, len - replay->buf_size);
+    replay->buf = buf;
+    replay->buf_size = len;
+    return buf;
+}
+
+static int64_t list_dir(fat32_volume_t *vol, const char *path) {
+    fat32_dir_t *dir = fat32_opendir(vol, path);
+    if (!dir)
+        return -1;
+
+    fat32_dirent_t entry;
+    int64_t entries = 0;
+    int ret;
+    while ((ret = fat32_readdir(dir, &entry)) == 1)
+        entries++;
+    fat32_closedir(dir);
+    return ret < 0 ? -1 : entries;
+}
+
+static int visit_nothing(const char *path, const fat32_dirent_t *entry, int depth, void *arg) {
+    (void)path;
+    (void)entry;
+    (void)depth;
+    (void)arg;
+    return 0;
+}
+
+static void remember_checkpoint(replay_t *replay, const char *name) {
+    if (strlen(name) > REPLAY_CHECKPOINT_NAME_MAX)
+        return;
+
+    for (int i = 0; i < replay->checkpoint_count; i++) {
+        if (strcmp(replay->checkpoints[i], name) == 0)
+            return;
+    }
+    if (replay->checkpoint_count < REPLAY_MAX_CHECKPOINTS)
+        strcpy(replay->checkpoints[replay->checkpoint_count++], name);
+}
+
+// removes what the replayed calls left next to the copy
+static void remove_scratch(replay_t *replay) {
+    unlink(replay->scratch_path);
+
+    char path[PATH_MAX];
+    for (int i = 0; i < replay->checkpoint_count; i++) {
+        if ((size_t)snprintf(path, sizeof(path), "%s.%s.ckpt", replay->copy_path,
+                             replay->checkpoints[i]) < sizeof(path))
+            unlink(path);
+    }
+}
+
+// runs one recorded call, returns its result
+static int64_t run_record(replay_t *replay, const trace_record_t *record, const char *path) {
+    fat32_volume_t *vol = replay->vol;
+    fat32_dirent_t entry;
+    fat32_usage_t usage;
+    fat32_frag_stats_t before;
+    fat32_frag_stats_t after;
+
+    switch (record->op) {
+    case TRACE_MKDIR:
+        return fat32_mkdir(vol, path);
+    case TRACE_TOUCH:
+        return fat32_touch(vol, path);
+    case TRACE_RM:
+        return fat32_rm(vol, path, record->flags);
+    case TRACE_RMDIR:
+        return fat32_rmdir(vol, path);
+    case TRACE_STAT:
+        return fat32_stat(vol, path, &entry);
+    case TRACE_READ:
+        if (!reserve_buf(replay, record->count))
+            return -1;
+        return fat32_read(vol, path, record->offset, replay->buf, record->count);
+    case TRACE_WRITE:
+        if (!reserve_buf(replay, record->count))
+            return -1;
+        return fat32_write(vol, path, record->offset, replay->buf, record->count);
+    case TRACE_LS:
+        return list_dir(vol, path);
+    case TRACE_COMPACT:
+        return fat32_compact(vol, path);
+    case TRACE_DEFRAG:
+        return fat32_defrag(vol, &before, &after);
+    case TRACE_DU:
+        return fat32_du(vol, path, (int)record->count, &usage);
+    case TRACE_BEGIN_BATCH:
+        fat32_begin_batch(vol);
+        return 0;
+    case TRACE_END_BATCH:
+        return fat32_end_batch(vol);
+    case TRACE_WALK:
+        return fat32_walk(vol, path, (int)record->count, visit_nothing, NULL);
+    case TRACE_IS_DIRECTORY:
+        return fat32_is_directory(vol, path);
+    case TRACE_EXISTS:
+        return fat32_exists(vol, path);
+    case TRACE_TRIM:
+        return fat32_trim(vol);
+    case TRACE_CHECKPOINT:
+        if (fat32_checkpoint(vol, path))
+            return -1;
+        remember_checkpoint(replay, path);
+        return 0;
+    case TRACE_DIFF:
+        return fat32_diff(vol, path, replay->scratch_path, record->flags);
+    case TRACE_FLATTEN:
+        return fat32_flatten(vol, replay->scratch_path);
+    case TRACE_SET_ALLOC_POLICY:
+        fat32_set_alloc_policy(vol, (int)record->count);
+        return 0;
+    }
+
+    fprintf(stderr, "unknown operation %u in trace\n", record->op);
+    return -1;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank percentile of sorted samples, in microseconds
+static double percentile(const uint64_t *sorted, size_t count, int p) {
+    size_t rank = (count * p + 99) / 100;
+    return sorted[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static void report(replay_t *replay, uint64_t elapsed) {
+    uint64_t total = 0;
+    for (int op = 1; op < TRACE_OP_COUNT; op++)
+        total += replay->ops[op].count;
+
+    printf("%llu calls in %.3f s, %.0f calls/s\n",
+           (unsigned long long)total,
+           elapsed / 1e9,
+           elapsed ? total * 1e9 / elapsed : 0.0);
+    printf("%-12s %8s %6s %6s %10s %9s %9s %9s %9s %9s %9s\n",
+           "op", "calls", "errors", "differ", "calls/s", "MiB/s",
+           "p50 us", "p90 us", "p99 us", "max us", "rec p50");
+
+    for (int op = 1; op < TRACE_OP_COUNT; op++) {
+        op_stats_t *stats = &replay->ops[op];
+        if (stats->count == 0)
+            continue;
+
+        uint64_t busy = 0;
+        for (size_t i = 0; i < stats->count; i++)
+            busy += stats->samples[i];
+
+        qsort(stats->samples, stats->count, sizeof(uint64_t), compare_u64);
+        qsort(stats->recorded, stats->count, sizeof(uint64_t), compare_u64);
+
+        double seconds = busy / 1e9;
+        printf("%-12s %8zu %6u %6u %10.0f %9.2f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+               trace_op_name(op),
+               stats->count,
+               stats->errors,
+               stats->diverged,
+               seconds > 0 ? stats->count / seconds : 0.0,
+               seconds > 0 ? stats->bytes / seconds / (1024 * 1024) : 0.0,
+               percentile(stats->samples, stats->count, 50),
+               percentile(stats->samples, stats->count, 90),
+               percentile(stats->samples, stats->count, 99),
+               stats->samples[stats->count - 1] / 1000.0,
+               percentile(stats->recorded, stats->count, 50));
+    }
+}
+
+static int replay_trace(replay_t *replay, FILE *trace) {
+    trace_record_t record;
+    char *path = malloc(TRACE_PATH_MAX + 1);
+    if (!path) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return -1;
+    }
+
+    int ret;
+    uint64_t begin = trace_now();
+    while ((ret = trace_read(trace, &record, path)) == 1) {
+        if (record.op == 0 || record.op >= TRACE_OP_COUNT) {
+            fprintf(stderr, "unknown operation %u in trace\n", record.op);
+            ret = -1;
+            break;
+        }
+
+        uint64_t start = trace_now();
+        int64_t result = run_record(replay, &record, path);
+        uint64_t duration = trace_now() - start;
+
+        op_stats_t *stats = &replay->ops[record.op];
+        if (add_sample(stats, duration, record.duration)) {
+            fprintf(stderr, "failed to allocate memory\n");
+            ret = -1;
+            break;
+        }
+        if (result < 0)
+            stats->errors++;
+        else if (record.op == TRACE_READ || record.op == TRACE_WRITE)
+            stats->bytes += result;
+        if ((result < 0) != (record.result < 0))
+            stats->diverged++;
+    }
+
+    if (ret == 0)
+        report(replay, trace_now() - begin);
+    free(path);
+    return ret;
+}
+
+int fat32_replay(const char *trace_path, const char *image_path) {
+    FILE *trace = trace_open(trace_path);
+    if (!trace)
+        return -1;
+
+    char copy_path[PATH_MAX];
+    if (copy_image(image_path, copy_path, sizeof(copy_path))) {
+        fclose(trace);
+        return -1;
+    }
+
+    replay_t replay = {0};
+    replay.copy_path = copy_path;
+    int ret = -1;
+    if ((size_t)snprintf(replay.scratch_path, sizeof(replay.scratch_path), "%s.out", copy_path) >=
+        sizeof(replay.scratch_path)) {
+        fprintf(stderr, "path is too long\n");
+        unlink(copy_path);
+        fclose(trace);
+        return -1;
+    }
+
+    replay.vol = fat32_mount(copy_path);
+    if (replay.vol) {
+        ret = replay_trace(&replay, trace);
+        fat32_unmount(replay.vol);
+    }
+
+    remove_scratch(&replay);
+    unlink(copy_path);
+    fclose(trace);
+    free(replay.buf);
+    for (int op = 0; op < TRACE_OP_COUNT; op++) {
+        free(replay.ops[op].samples);
+        free(replay.ops[op].recorded);
+    }
+    return ret;
+}
@@ -0,0 +1,9 @@
+#ifndef FAT32_REPLAY_H
+#define FAT32_REPLAY_H
+
+// re-executes a trace recorded with fat32_trace against a copy of image_path, which must be the
+// image the recording started from, and prints throughput and latency percentiles per operation.
+// The image itself is left untouched
+int fat32_replay(const char *trace_path, const char *image_path);
+
+#endif
@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_MAX_PATH 4096
+#define SERVER_MAX_IO (1024 * 1024)
+#define SERVER_READ_CHUNK (64 * 1024)
+// past this many buffered bytes of requests or unsent responses a client is not read from until it
+// catches up. Larger than the biggest request, so a complete one always fits
+#define SERVER_MAX_BACKLOG (4 * SERVER_MAX_IO)
+
+typedef struct {
+    int fd;
+    uint8_t *in;
+    size_t in_len;
+    size_t in_cap;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+    size_t out_sent;
+    // where the responses of the current round start in out
+    size_t round_start;
+    // complete requests are waiting for the responses to drain
+    int stalled;
+    // peer closed its end, dropped once the pending responses are sent
+    int hangup;
+} client_t;
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static int reserve(uint8_t **buf, size_t *cap, size_t needed) {
+    if (needed <= *cap)
+        return 0;
+
+    size_t capacity = *cap ? *cap : 4096;
+    while (capacity < needed)
+        capacity *= 2;
+
+    uint8_t *tmp = realloc(*buf, capacity);
+    if (!tmp)
+        return -1;
+
+    *buf = tmp;
+    *cap = capacity;
+    return 0;
+}
+
+static int out_append(client_t *client, const void *data, size_t len) {
+    if (reserve(&client->out, &client->out_cap, client->out_len + len))
+        return -1;
+
+    memcpy(client->out + client->out_len, data, len);
+    client->out_len += len;
+    return 0;
+}
+
+static void close_client(client_t *client) {
+    close(client->fd);
+    free(client->in);
+    free(client->out);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+}
+
+// appends the response for one request, the header is written once the payload is known
+static int handle_request(fat32_volume_t *vol,
+                          client_t *client,
+                          const server_request_t *req,
+                          const uint8_t *body) {
+    uint16_t path_len = le16toh(req->path_len);
+    uint32_t count = le32toh(req->count);
+    uint64_t offset = le64toh(req->offset);
+
+    char path[SERVER_MAX_PATH + 1];
+    memcpy(path, body, path_len);
+    path[path_len] = '\0';
+
+    size_t header_pos = client->out_len;
+    server_response_t resp = {0};
+    if (out_append(client, &resp, sizeof(resp)))
+        return -1;
+
+    int32_t status = -1;
+
+    switch (req->op) {
+    case FAT32_OP_MKDIR:
+        status = fat32_mkdir(vol, path);
+        break;
+    case FAT32_OP_TOUCH:
+        status = fat32_touch(vol, path);
+        break;
+    case FAT32_OP_STAT: {
+        fat32_dirent_t entry;
+        if (fat32_stat(vol, path, &entry) == 0) {
+            server_stat_t stat;
+            stat.attr = entry.attr;
+            stat.size = htole32(entry.size);
+            stat.first_cluster = htole32(entry.first_cluster);
+            stat.wrt_date = htole16(entry.wrt_date);
+            stat.wrt_time = htole16(entry.wrt_time);
+            if (out_append(client, &stat, sizeof(stat)))
+                return -1;
+            status = 0;
+        }
+        break;
+    }
+    case FAT32_OP_LS: {
+        fat32_dir_t *dir = fat32_opendir(vol, path);
+        if (!dir)
+            break;
+
+        fat32_dirent_t entry;
+        int ret;
+        status = 0;
+        while ((ret = fat32_readdir(dir, &entry)) > 0) {
+            server_ls_entry_t ls;
+            ls.attr = entry.attr;
+            ls.size = htole32(entry.size);
+            size_t name_len = strlen(entry.name);
+            ls.name_len = htole16(name_len);
+            if (out_append(client, &ls, sizeof(ls)) ||
+                out_append(client, entry.name, name_len)) {
+                fat32_closedir(dir);
+                return -1;
+            }
+            status++;
+        }
+        if (ret < 0) {
+            client->out_len = header_pos + sizeof(resp);
+            status = -1;
+        }
+        fat32_closedir(dir);
+        break;
+    }
+    case FAT32_OP_READ: {
+        if (count > SERVER_MAX_IO)
+            count = SERVER_MAX_IO;
+        if (reserve(&client->out, &client->out_cap, client->out_len + count))
+            return -1;
+
+        int64_t read = fat32_read(vol, path, offset, client->out + client->out_len, count);
+        if (read >= 0) {
+            client->out_len += read;
+            status = read;
+        }
+        break;
+    }
+    case FAT32_OP_WRITE: {
+        int64_t written = fat32_write(vol, path, offset, body + path_len, count);
+        status = written >= 0 ? written : -1;
+        break;
+    }
+    default:
+        fprintf(stderr, "unknown request %u\n", req->op);
+        break;
+    }
+
+    resp.length = htole32(client->out_len - header_pos - sizeof(resp));
+    resp.id = req->id;
+    resp.status = htole32(status);
+    memcpy(client->out + header_pos, &resp, sizeof(resp));
+    return 0;
+}
+
+// turns every response of the round into an error without payload, for when the round's commit
+// failed and the results the responses report never reached the image
+static void fail_round(client_t *client) {
+    size_t pos = client->round_start;
+    size_t end = client->round_start;
+
+    while (pos < client->out_len) {
+        server_response_t resp;
+        memcpy(&resp, client->out + pos, sizeof(resp));
+        pos += sizeof(resp) + le32toh(resp.length);
+
+        resp.length = 0;
+        resp.status = htole32(-1);
+        memcpy(client->out + end, &resp, sizeof(resp));
+        end += sizeof(resp);
+    }
+
+    client->out_len = end;
+}
+
+// handles every complete request buffered for a client, returns -1 if the client has to go
+static int process_client(fat32_volume_t *vol, client_t *client) {
+    size_t pos = 0;
+
+    client->stalled = 0;
+    while (client->in_len - pos >= sizeof(server_request_t)) {
+        if (client->out_len >= SERVER_MAX_BACKLOG) {
+            client->stalled = 1;
+            break;
+        }
+
+        server_request_t req;
+        memcpy(&req, client->in + pos, sizeof(req));
+
+        uint32_t length = le32toh(req.length);
+        uint16_t path_len = le16toh(req.path_len);
+        uint32_t data_len = req.op == FAT32_OP_WRITE ? le32toh(req.count) : 0;
+        if (path_len > SERVER_MAX_PATH || data_len > SERVER_MAX_IO ||
+            length != path_len + data_len) {
+            fprintf(stderr, "malformed request, dropping client\n");
+            return -1;
+        }
+
+        if (client->in_len - pos < sizeof(req) + length)
+            break;
+
+        if (handle_request(vol, client, &req, client->in + pos + sizeof(req)))
+            return -1;
+        pos += sizeof(req) + length;
+    }
+
+    memmove(client->in, client->in + pos, client->in_len - pos);
+    client->in_len -= pos;
+    return 0;
+}
+
+static int read_client(client_t *client) {
+    while (client->in_len < SERVER_MAX_BACKLOG) {
+        if (reserve(&client->in, &client->in_cap, client->in_len + SERVER_READ_CHUNK))
+            return -1;
+
+        ssize_t n = read(client->fd, client->in + client->in_len, SERVER_READ_CHUNK);
+        if (n > 0) {
+            client->in_len += n;
+            continue;
+        }
+        if (n == 0)
+            return -1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static int write_client(client_t *client) {
+    while (client->out_sent < client->out_len) {
+        ssize_t n = send(client->fd,
+                         client->out + client->out_sent,
+                         client->out_len - client->out_sent,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            client->out_sent += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 && errno == EINTR)
+            continue;
+        return -1;
+    }
+
+    client->out_len = client->out_sent = 0;
+    return 0;
+}
+
+// the image lock does not cover the socket path, so a socket some server still listens on is left
+// alone and only a stale one is removed
+static int clear_socket_path(const struct sockaddr_un *addr) {
+    struct stat st;
+    if (lstat(addr->sun_path, &st))
+        return 0;
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "%s exists and is not a socket\n", addr->sun_path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create socket\n");
+        return -1;
+    }
+
+    int ret = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+    int err = errno;
+    close(fd);
+
+    if (ret == 0) {
+        fprintf(stderr, "%s is in use by another server\n", addr->sun_path);
+        return -1;
+    }
+    if (err != ECONNREFUSED) {
+        fprintf(stderr, "failed to check %s\n", addr->sun_path);
+        return -1;
+    }
+
+    unlink(addr->sun_path);
+    return 0;
+}
+
+static int open_socket(const char *socket_path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create socket\n");
+        return -1;
+    }
+
+    if (clear_socket_path(&addr)) {
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+        fprintf(stderr, "failed to listen on %s\n", socket_path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int fat32_serve(fat32_volume_t *vol, const char *socket_path) {
+    int listen_fd = open_socket(socket_path);
+    if (listen_fd < 0)
+        return -1;
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    client_t clients[SERVER_MAX_CLIENTS];
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        memset(&clients[i], 0, sizeof(clients[i]));
+        clients[i].fd = -1;
+    }
+
+    struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+    int ret = 0;
+
+    while (!stopping) {
+        int nfds = 0;
+        fds[nfds].fd = listen_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+
+        // stalled clients whose responses have drained are served again without waiting
+        int timeout = -1;
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            client_t *client = &clients[i];
+            int backlogged = client->in_len >= SERVER_MAX_BACKLOG ||
+                             client->out_len >= SERVER_MAX_BACKLOG;
+            fds[nfds].fd = client->fd;
+            fds[nfds].events = client->hangup || backlogged ? 0 : POLLIN;
+            if (client->out_len)
+                fds[nfds].events |= POLLOUT;
+            fds[nfds].revents = 0;
+            nfds++;
+
+            if (client->fd >= 0 && client->stalled && client->out_len < SERVER_MAX_BACKLOG)
+                timeout = 0;
+        }
+
+        if (poll(fds, nfds, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "poll failed\n");
+            ret = -1;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                int slot = 0;
+                while (slot < SERVER_MAX_CLIENTS && clients[slot].fd >= 0)
+                    slot++;
+                if (slot == SERVER_MAX_CLIENTS) {
+                    close(fd);
+                    continue;
+                }
+                clients[slot].fd = fd;
+            }
+        }
+
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            short revents = fds[i + 1].revents;
+            if (clients[i].fd < 0 || clients[i].hangup || !revents)
+                continue;
+            // a client that hung up still gets the requests it sent so far executed
+            if ((revents & (POLLIN | POLLHUP | POLLERR)) && read_client(&clients[i]))
+                clients[i].hangup = 1;
+        }
+
+        // every request that arrived in this round shares one commit, responses go out only
+        // after it
+        fat32_begin_batch(vol);
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            clients[i].round_start = clients[i].out_len;
+            if (clients[i].fd >= 0 && clients[i].in_len && process_client(vol, &clients[i]))
+                close_client(&clients[i]);
+        }
+        if (fat32_end_batch(vol)) {
+            fprintf(stderr, "failed to commit batch\n");
+            for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+                if (clients[i].fd >= 0)
+                    fail_round(&clients[i]);
+            }
+        }
+
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            if (clients[i].fd < 0)
+                continue;
+            if (write_client(&clients[i]) || (clients[i].hangup && !clients[i].out_len))
+                close_client(&clients[i]);
+        }
+    }
+
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0)
+            close_client(&clients[i]);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef FAT32_SERVER_H
+#define FAT32_SERVER_H
+
+#include <stdint.h>
+
+#include "fat32.h"
+
+// wire protocol, every integer is little endian. A request is a server_request_t followed by
+// path_len bytes of path (not NUL terminated) and, for writes, count bytes of data. A response is
+// a server_response_t followed by length bytes of payload. Requests on one connection may be
+// pipelined, responses carry the id of their request and come back in order
+
+#define FAT32_OP_MKDIR 1
+#define FAT32_OP_TOUCH 2
+// payload: per entry a server_ls_entry_t followed by name_len bytes of name, status is the count
+#define FAT32_OP_LS 3
+// reads up to count bytes at offset, payload is the data, status the number of bytes
+#define FAT32_OP_READ 4
+// writes count bytes at offset, status is the number of bytes written
+#define FAT32_OP_WRITE 5
+// payload: server_stat_t
+#define FAT32_OP_STAT 6
+
+typedef struct {
+    // bytes following this header
+    uint32_t length;
+    uint32_t id;
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t path_len;
+    uint64_t offset;
+    uint32_t count;
+} __attribute__((packed)) server_request_t;
+
+typedef struct {
+    // bytes following this header
+    uint32_t length;
+    uint32_t id;
+    // negative on failure
+    int32_t status;
+} __attribute__((packed)) server_response_t;
+
+typedef struct {
+    uint8_t attr;
+    uint32_t size;
+    uint32_t first_cluster;
+    uint16_t wrt_date;
+    uint16_t wrt_time;
+} __attribute__((packed)) server_stat_t;
+
+typedef struct {
+    uint8_t attr;
+    uint32_t size;
+    uint16_t name_len;
+} __attribute__((packed)) server_ls_entry_t;
+
+// serves the volume on a Unix domain socket until SIGINT or SIGTERM
+int fat32_serve(fat32_volume_t *vol, const char *socket_path);
+
+#endif
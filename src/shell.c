@@ -1,58 +1,274 @@
+#define _GNU_SOURCE
+
 #include "shell.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fnmatch.h>
+#include <pthread.h>
 
 #include "fat32.h"
 
-static char **split_input(char *input, int *words) {
-    if (!input)
-        return NULL;
+#define OUT_BUF_SIZE (64 * 1024)
 
-    int capacity = 10;
-    int count = 0;
-    char **result = malloc(capacity * sizeof(char *));
-    if (!result)
-        return NULL;
-
-    char *token = strtok(input, " \t\r\n");
-    while (token) {
-        if (count >= capacity) {
-            capacity *= 2;
-            char **tmp = realloc(result, capacity * sizeof(char *));
-            if (!tmp) {
-                for (int i = 0; i < count; i++)
-                    free(result[i]);
-                free(result);
-                return NULL;
-            }
-            result = tmp;
+typedef struct {
+    char data[OUT_BUF_SIZE];
+    size_t len;
+} out_buf_t;
+
+static out_buf_t out;
+
+static void out_flush() {
+    if (out.len) {
+        fwrite(out.data, 1, out.len, stdout);
+        out.len = 0;
+    }
+}
+
+static void out_write(const char *str, size_t len) {
+    if (out.len + len > OUT_BUF_SIZE)
+        out_flush();
+    memcpy(out.data + out.len, str, len);
+    out.len += len;
+}
+
+static void out_entry(const fat32_dirent_t *entry, int long_format) {
+    if (!long_format) {
+        size_t len = strlen(entry->name);
+        out_write(entry->name, len);
+        out_write(" ", 1);
+        return;
+    }
+
+    // long names do not fit the line buffer, they are written after it
+    char line[64];
+    int len = snprintf(line,
+                       sizeof(line),
+                       "%c %10u %04u-%02u-%02u %02u:%02u ",
+                       (entry->attr & FAT32_ATTR_DIRECTORY) ? 'd' : '-',
+                       entry->size,
+                       (entry->wrt_date >> 9) + 1980,
+                       (entry->wrt_date >> 5) & 0x0F,
+                       entry->wrt_date & 0x1F,
+                       entry->wrt_time >> 11,
+                       (entry->wrt_time >> 5) & 0x3F);
+    out_write(line, len);
+    out_write(entry->name, strlen(entry->name));
+    out_write("\n", 1);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const fat32_dirent_t *)a)->name, ((const fat32_dirent_t *)b)->name);
+}
+
+// grow-only buffer for sorted listings, kept across commands
+static fat32_dirent_t *sort_buf;
+static size_t sort_capacity;
+
+static int shell_ls(fat32_volume_t *vol, const char *path, int long_format, int sorted) {
+    fat32_dir_t *dir = fat32_opendir(vol, path);
+    if (!dir)
+        return -1;
+
+    fat32_dirent_t entry;
+    int ret;
+
+    if (!sorted) {
+        while ((ret = fat32_readdir(dir, &entry)) > 0)
+            out_entry(&entry, long_format);
+    } else {
+        size_t count = 0;
+
+        while ((ret = fat32_readdir(dir, &entry)) > 0) {
+            if (count == sort_capacity) {
+                size_t capacity = sort_capacity ? sort_capacity * 2 : 64;
+                fat32_dirent_t *tmp = realloc(sort_buf, capacity * sizeof(fat32_dirent_t));
+                if (!tmp) {
+                    ret = -1;
+                    break;
+                }
+                sort_buf = tmp;
+                sort_capacity = capacity;
+            }
+            sort_buf[count++] = entry;
         }
 
-        result[count] = strdup(token);
-        if (!result[count]) {
-            for (int i = 0; i < count; i++)
-                free(result[i]);
-            free(result);
-            return NULL;
+        qsort(sort_buf, count, sizeof(fat32_dirent_t), compare_entries);
+        for (size_t i = 0; i < count; i++)
+            out_entry(&sort_buf[i], long_format);
+    }
+
+    if (!long_format)
+        out_write("\n", 1);
+    out_flush();
+
+    fat32_closedir(dir);
+    return ret;
+}
+
+// walk callbacks run on many threads, output and collected nodes are guarded by one lock
+typedef struct {
+    char *path;
+    const char *name;
+    int depth;
+    uint8_t attr;
+} tree_node_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    const char *pattern;
+    tree_node_t *nodes;
+    size_t count;
+    size_t capacity;
+    int failed;
+} walk_ctx_t;
+
+static int find_visit(const char *path, const fat32_dirent_t *entry, int depth, void *arg) {
+    (void)depth;
+    walk_ctx_t *ctx = arg;
+
+    if (fnmatch(ctx->pattern, entry->name, FNM_CASEFOLD) != 0)
+        return 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    out_write(path, strlen(path));
+    out_write("\n", 1);
+    ctx->count++;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+static int tree_visit(const char *path, const fat32_dirent_t *entry, int depth, void *arg) {
+    walk_ctx_t *ctx = arg;
+    char *copy = strdup(path);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (copy && ctx->count == ctx->capacity) {
+        size_t capacity = ctx->capacity ? ctx->capacity * 2 : 256;
+        tree_node_t *tmp = realloc(ctx->nodes, capacity * sizeof(tree_node_t));
+        if (tmp) {
+            ctx->nodes = tmp;
+            ctx->capacity = capacity;
         }
+    }
+    if (!copy || ctx->count == ctx->capacity) {
+        ctx->failed = 1;
+        pthread_mutex_unlock(&ctx->lock);
+        free(copy);
+        return 1;
+    }
+
+    tree_node_t *node = &ctx->nodes[ctx->count++];
+    node->path = copy;
+    node->name = strrchr(copy, '/') + 1;
+    node->depth = depth;
+    node->attr = entry->attr;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+// orders paths so every directory is directly followed by its contents
+static int compare_tree_nodes(const void *a, const void *b) {
+    const unsigned char *p = (const unsigned char *)((const tree_node_t *)a)->path;
+    const unsigned char *q = (const unsigned char *)((const tree_node_t *)b)->path;
 
-        count++;
-        token = strtok(NULL, " \t\r\n");
+    while (*p && *p == *q) {
+        p++;
+        q++;
     }
 
-    *words = count;
+    int rank_p = *p == '/' ? 1 : *p ? *p + 2 : 0;
+    int rank_q = *q == '/' ? 1 : *q ? *q + 2 : 0;
+    return rank_p - rank_q;
+}
+
+static int shell_tree(fat32_volume_t *vol, const char *path) {
+    walk_ctx_t ctx = {0};
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    int ret = fat32_walk(vol, path, 0, tree_visit, &ctx);
+    if (ret == 0 && ctx.failed) {
+        fprintf(stderr, "failed to allocate memory\n");
+        ret = -1;
+    }
 
-    result = realloc(result, (count + 1) * sizeof(char *));
-    result[count] = NULL;
+    if (ret == 0) {
+        qsort(ctx.nodes, ctx.count, sizeof(tree_node_t), compare_tree_nodes);
 
-    return result;
+        size_t dirs = 0;
+        out_write(path, strlen(path));
+        out_write("\n", 1);
+        for (size_t i = 0; i < ctx.count; i++) {
+            const tree_node_t *node = &ctx.nodes[i];
+            for (int level = 0; level <= node->depth; level++)
+                out_write("  ", 2);
+            out_write(node->name, strlen(node->name));
+            if (node->attr & FAT32_ATTR_DIRECTORY) {
+                out_write("/", 1);
+                dirs++;
+            }
+            out_write("\n", 1);
+        }
+        out_flush();
+        printf("%zu directories, %zu files\n", dirs, ctx.count - dirs);
+    }
+
+    for (size_t i = 0; i < ctx.count; i++)
+        free(ctx.nodes[i].path);
+    free(ctx.nodes);
+    pthread_mutex_destroy(&ctx.lock);
+    return ret;
+}
+
+static void print_frag_stats(const char *label, const fat32_frag_stats_t *stats) {
+    uint32_t links = stats->clusters - stats->chains;
+    double score = links ? 100.0 * stats->breaks / links : 0.0;
+
+    printf("%s: %.1f%% fragmented, %u of %u chains in more than one piece\n",
+           label,
+           score,
+           stats->fragmented,
+           stats->chains);
 }
 
-int lauch_shell(const char *filepath) {
-    char *cwd = malloc(2);
-    strcpy(cwd, "/");
+#define MAX_WORDS 16
+#define MAX_PATH_LEN 4096
+
+// splits input in place, words point into input
+static int split_input(char *input, char **words, int max_words) {
+    int count = 0;
+    char *p = input;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            *p++ = '\0';
+        if (!*p)
+            break;
+
+        if (count == max_words)
+            return -1;
+        words[count++] = p;
+
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            p++;
+    }
+
+    return count;
+}
+
+int lauch_shell(const char *filepath, const char *delta_path, const char *trace_path) {
+    fat32_volume_t *vol = delta_path ? fat32_mount_overlay(filepath, delta_path)
+                                     : fat32_mount(filepath);
+    if (!vol)
+        return -1;
+
+    if (trace_path && fat32_trace(vol, trace_path)) {
+        fat32_unmount(vol);
+        return -1;
+    }
+
+    char cwd[MAX_PATH_LEN] = "/";
 
     char *line = NULL;
     size_t len = 0;
@@ -67,64 +283,221 @@ int lauch_shell(const char *filepath) {
             break;
         }
 
-        int word_count = 0;
-        char **words = split_input(line, &word_count);
+        char *words[MAX_WORDS];
+        int word_count = split_input(line, words, MAX_WORDS);
 
         if (word_count == 0) {
             // skip next checks
+        } else if (word_count < 0) {
+            printf("too many arguments\n");
         } else if (strcmp(words[0], "format") == 0) {
             if (word_count != 1) {
                 printf("invalid amount of arguments\nusage: format\n");
+            } else if (delta_path) {
+                printf("format is not supported on overlays\n");
             } else {
+                fat32_unmount(vol);
                 remove(filepath);
                 create_fat32_file(filepath);
-                cwd = realloc(cwd, 2);
+                vol = fat32_mount(filepath);
+                if (!vol)
+                    break;
                 strcpy(cwd, "/");
             }
         } else if (strcmp(words[0], "ls") == 0) {
-            if (word_count != 1 && word_count != 2) {
-                printf("invalid amount of arguments\nusage: ls [path]\n");
+            int long_format = 0;
+            int sorted = 0;
+            int arg = 1;
+            for (; arg < word_count && words[arg][0] == '-' && words[arg][1]; arg++) {
+                for (char *flag = words[arg] + 1; *flag; flag++) {
+                    if (*flag == 'l')
+                        long_format = 1;
+                    else if (*flag == 's')
+                        sorted = 1;
+                    else
+                        long_format = -1;
+                }
+            }
+
+            if (long_format < 0 || word_count - arg > 1) {
+                printf("invalid arguments\nusage: ls [-l] [-s] [path]\n");
             } else {
-                char *path = word_count == 1 ? cwd : words[1];
-                fat32_ls(filepath, path);
+                char *path = arg == word_count ? cwd : words[arg];
+                shell_ls(vol, path, long_format, sorted);
             }
         } else if (strcmp(words[0], "cd") == 0) {
             if (word_count != 2) {
                 printf("invalid amount of arguments\nusage: cd <path>\n");
-            } else if (fat32_is_directory(filepath, words[1])) {
-                char *tmp = words[1];
-                words[1] = cwd;
-                cwd = tmp;
+            } else if (strlen(words[1]) >= MAX_PATH_LEN) {
+                printf("path is too long\n");
+            } else if (fat32_is_directory(vol, words[1])) {
+                strcpy(cwd, words[1]);
             } else {
                 printf("no such directory\n");
             }
         } else if (strcmp(words[0], "mkdir") == 0) {
             if (word_count != 2) {
                 printf("invalid amount of arguments\nusage: mkdir <path>\n");
-            } else if (fat32_exists(filepath, words[1])) {
+            } else if (fat32_exists(vol, words[1])) {
                 printf("%s already exists\n", words[1]);
             } else {
-                fat32_mkdir(filepath, words[1]);
+                fat32_mkdir(vol, words[1]);
             }
         } else if (strcmp(words[0], "touch") == 0) {
             if (word_count != 2) {
                 printf("invalid amount of arguments\nusage: touch <path>\n");
-            } else if (fat32_exists(filepath, words[1])) {
+            } else if (fat32_exists(vol, words[1])) {
                 printf("%s already exists\n", words[1]);
             } else {
-                fat32_touch(filepath, words[1]);
+                fat32_touch(vol, words[1]);
+            }
+        } else if (strcmp(words[0], "rm") == 0) {
+            int recursive = word_count == 3 && strcmp(words[1], "-r") == 0;
+            if (word_count != 2 && !recursive) {
+                printf("invalid amount of arguments\nusage: rm [-r] <path>\n");
+            } else {
+                fat32_rm(vol, words[word_count - 1], recursive);
+                if (!fat32_is_directory(vol, cwd))
+                    strcpy(cwd, "/");
             }
+        } else if (strcmp(words[0], "rmdir") == 0) {
+            if (word_count != 2) {
+                printf("invalid amount of arguments\nusage: rmdir <path>\n");
+            } else {
+                fat32_rmdir(vol, words[1]);
+                if (!fat32_is_directory(vol, cwd))
+                    strcpy(cwd, "/");
+            }
+        } else if (strcmp(words[0], "compact") == 0) {
+            if (word_count != 1 && word_count != 2) {
+                printf("invalid amount of arguments\nusage: compact [path]\n");
+            } else {
+                int ret = fat32_compact(vol, word_count == 1 ? cwd : words[1]);
+                if (ret >= 0)
+                    printf("%d deleted entries dropped\n", ret);
+            }
+        } else if (strcmp(words[0], "defrag") == 0) {
+            if (word_count != 1) {
+                printf("invalid amount of arguments\nusage: defrag\n");
+            } else {
+                fat32_frag_stats_t before, after;
+                if (fat32_defrag(vol, &before, &after) == 0) {
+                    print_frag_stats("before", &before);
+                    print_frag_stats("after", &after);
+                }
+            }
+        } else if (strcmp(words[0], "alloc") == 0) {
+            if (word_count == 2 && strcmp(words[1], "first-fit") == 0) {
+                fat32_set_alloc_policy(vol, FAT32_ALLOC_FIRST_FIT);
+            } else if (word_count == 2 && strcmp(words[1], "next-fit") == 0) {
+                fat32_set_alloc_policy(vol, FAT32_ALLOC_NEXT_FIT);
+            } else if (word_count == 2 && strcmp(words[1], "goal") == 0) {
+                fat32_set_alloc_policy(vol, FAT32_ALLOC_GOAL);
+            } else {
+                printf("invalid arguments\nusage: alloc <first-fit|next-fit|goal>\n");
+            }
+        } else if (strcmp(words[0], "trim") == 0) {
+            if (word_count != 1) {
+                printf("invalid amount of arguments\nusage: trim\n");
+            } else {
+                int64_t trimmed = fat32_trim(vol);
+                if (trimmed >= 0)
+                    printf("%lld free clusters trimmed\n", (long long)trimmed);
+            }
+        } else if (strcmp(words[0], "flatten") == 0) {
+            if (word_count != 2) {
+                printf("invalid amount of arguments\nusage: flatten <output>\n");
+            } else {
+                fat32_flatten(vol, words[1]);
+            }
+        } else if (strcmp(words[0], "checkpoint") == 0) {
+            if (word_count != 2) {
+                printf("invalid amount of arguments\nusage: checkpoint <name>\n");
+            } else {
+                fat32_checkpoint(vol, words[1]);
+            }
+        } else if (strcmp(words[0], "diff") == 0 || strcmp(words[0], "sync") == 0) {
+            if (word_count != 3) {
+                printf("invalid amount of arguments\nusage: %s <checkpoint> <output>\n", words[0]);
+            } else {
+                int64_t bytes = fat32_diff(vol, words[1], words[2], words[0][0] == 's');
+                if (bytes >= 0)
+                    printf("%lld changed bytes written\n", (long long)bytes);
+            }
+        } else if (strcmp(words[0], "apply") == 0) {
+            if (word_count != 3) {
+                printf("invalid amount of arguments\nusage: apply <diff> <image>\n");
+            } else {
+                fat32_apply_diff(words[1], words[2]);
+            }
+        } else if (strcmp(words[0], "stat") == 0) {
+            fat32_dirent_t entry;
+            if (word_count != 2) {
+                printf("invalid amount of arguments\nusage: stat <path>\n");
+            } else if (fat32_stat(vol, words[1], &entry) == 0) {
+                out_entry(&entry, 1);
+                out_flush();
+            }
+        } else if (strcmp(words[0], "cat") == 0) {
+            if (word_count != 2) {
+                printf("invalid amount of arguments\nusage: cat <path>\n");
+            } else {
+                uint64_t offset = 0;
+                int64_t read;
+                while ((read = fat32_read(vol, words[1], offset, out.data, OUT_BUF_SIZE)) > 0) {
+                    fwrite(out.data, 1, read, stdout);
+                    offset += read;
+                }
+            }
+        } else if (strcmp(words[0], "append") == 0) {
+            fat32_dirent_t entry;
+            if (word_count < 3) {
+                printf("invalid amount of arguments\nusage: append <path> <text>\n");
+            } else if (fat32_stat(vol, words[1], &entry) == 0) {
+                // the words were split in place, put the text back together with single spaces
+                for (int i = 2; i < word_count; i++) {
+                    size_t len = strlen(words[i]);
+                    words[i][len] = i + 1 < word_count ? ' ' : '\n';
+                    fat32_write(vol, words[1], entry.size, words[i], len + 1);
+                    entry.size += len + 1;
+                }
+            }
+        } else if (strcmp(words[0], "find") == 0) {
+            if (word_count != 2 && word_count != 3) {
+                printf("invalid amount of arguments\nusage: find <pattern> [path]\n");
+            } else {
+                walk_ctx_t ctx = {0};
+                pthread_mutex_init(&ctx.lock, NULL);
+                ctx.pattern = words[1];
+                fat32_walk(vol, word_count == 3 ? words[2] : cwd, 0, find_visit, &ctx);
+                out_flush();
+                pthread_mutex_destroy(&ctx.lock);
+            }
+        } else if (strcmp(words[0], "du") == 0) {
+            fat32_usage_t usage;
+            if (word_count > 2) {
+                printf("invalid amount of arguments\nusage: du [path]\n");
+            } else if (fat32_du(vol, word_count == 2 ? words[1] : cwd, 0, &usage) == 0) {
+                printf("%llu files, %llu directories, %llu bytes, "
+                       "%llu allocated in %llu clusters\n",
+                       (unsigned long long)usage.files,
+                       (unsigned long long)usage.dirs,
+                       (unsigned long long)usage.bytes,
+                       (unsigned long long)usage.allocated,
+                       (unsigned long long)usage.clusters);
+            }
+        } else if (strcmp(words[0], "tree") == 0) {
+            if (word_count > 2)
+                printf("invalid amount of arguments\nusage: tree [path]\n");
+            else
+                shell_tree(vol, word_count == 2 ? words[1] : cwd);
         } else {
             printf("no such command\n");
         }
-
-        for (int i = 0; i < word_count; i++) {
-            free(words[i]);
-        }
-        free(words);
     }
 
-    free(cwd);
+    fat32_unmount(vol);
+    free(sort_buf);
     free(line);
     return 0;
 }
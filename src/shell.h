@@ -1,6 +1,8 @@
 #ifndef FAT32_SHELL_H
 #define FAT32_SHELL_H
 
-int lauch_shell(const char *filepath);
+// with delta_path set, filepath is used as the read-only base of an overlay. With trace_path set
+// the calls of the session are recorded there, until a format replaces the image
+int lauch_shell(const char *filepath, const char *delta_path, const char *trace_path);
 
 #endif
@@ -0,0 +1,177 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <time.h>
+
+struct trace {
+    FILE *file;
+    uint64_t base;
+    // set after a failed write, the rest of the recording is dropped
+    int failed;
+};
+
+static const char *op_names[TRACE_OP_COUNT] = {
+    [TRACE_MKDIR] = "mkdir",
+    [TRACE_TOUCH] = "touch",
+    [TRACE_RM] = "rm",
+    [TRACE_RMDIR] = "rmdir",
+    [TRACE_STAT] = "stat",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_LS] = "ls",
+    [TRACE_COMPACT] = "compact",
+    [TRACE_DEFRAG] = "defrag",
+    [TRACE_DU] = "du",
+    [TRACE_BEGIN_BATCH] = "begin_batch",
+    [TRACE_END_BATCH] = "end_batch",
+    [TRACE_WALK] = "walk",
+    [TRACE_IS_DIRECTORY] = "is_directory",
+    [TRACE_EXISTS] = "exists",
+    [TRACE_TRIM] = "trim",
+    [TRACE_CHECKPOINT] = "checkpoint",
+    [TRACE_DIFF] = "diff",
+    [TRACE_FLATTEN] = "flatten",
+    [TRACE_SET_ALLOC_POLICY] = "alloc_policy",
+};
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char *trace_op_name(int op) {
+    if (op <= 0 || op >= TRACE_OP_COUNT)
+        return "unknown";
+    return op_names[op];
+}
+
+trace_t *trace_create(const char *path) {
+    trace_t *trace = calloc(1, sizeof(trace_t));
+    if (!trace) {
+        fprintf(stderr, "failed to allocate memory\n");
+        return NULL;
+    }
+
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        fprintf(stderr, "failed to create %s\n", path);
+        free(trace);
+        return NULL;
+    }
+
+    trace_header_t header = {0};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = htole32(TRACE_VERSION);
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+        fprintf(stderr, "failed to write %s\n", path);
+        fclose(trace->file);
+        free(trace);
+        return NULL;
+    }
+
+    trace->base = trace_now();
+    return trace;
+}
+
+uint64_t trace_start(trace_t *trace) {
+    return trace ? trace_now() : 0;
+}
+
+void trace_add(trace_t *trace,
+               int op,
+               const char *path,
+               int flags,
+               uint64_t offset,
+               uint32_t count,
+               uint64_t start,
+               int64_t result) {
+    if (!trace || trace->failed)
+        return;
+
+    uint64_t end = trace_now();
+    size_t path_len = path ? strlen(path) : 0;
+    if (path_len > TRACE_PATH_MAX)
+        path_len = TRACE_PATH_MAX;
+
+    trace_record_t record;
+    record.op = op;
+    record.flags = flags;
+    record.path_len = htole16(path_len);
+    record.count = htole32(count);
+    record.offset = htole64(offset);
+    record.start = htole64(start - trace->base);
+    record.duration = htole64(end - start);
+    record.result = htole64(result);
+
+    if (fwrite(&record, sizeof(record), 1, trace->file) != 1 ||
+        (path_len && fwrite(path, 1, path_len, trace->file) != path_len)) {
+        fprintf(stderr, "failed to write trace, recording stopped\n");
+        trace->failed = 1;
+    }
+}
+
+int trace_close(trace_t *trace) {
+    if (!trace)
+        return 0;
+
+    int ret = trace->failed ? -1 : 0;
+    if (fclose(trace->file)) {
+        fprintf(stderr, "failed to write trace\n");
+        ret = -1;
+    }
+    free(trace);
+    return ret;
+}
+
+FILE *trace_open(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return NULL;
+    }
+
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a trace\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if (le32toh(header.version) != TRACE_VERSION) {
+        fprintf(stderr, "unsupported trace version %u\n", le32toh(header.version));
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+int trace_read(FILE *file, trace_record_t *record, char *path) {
+    trace_record_t raw;
+    size_t got = fread(&raw, 1, sizeof(raw), file);
+    if (got == 0 && feof(file))
+        return 0;
+    if (got != sizeof(raw)) {
+        fprintf(stderr, "truncated trace record\n");
+        return -1;
+    }
+
+    record->op = raw.op;
+    record->flags = raw.flags;
+    record->path_len = le16toh(raw.path_len);
+    record->count = le32toh(raw.count);
+    record->offset = le64toh(raw.offset);
+    record->start = le64toh(raw.start);
+    record->duration = le64toh(raw.duration);
+    record->result = (int64_t)le64toh(raw.result);
+
+    if (fread(path, 1, record->path_len, file) != record->path_len) {
+        fprintf(stderr, "truncated trace record\n");
+        return -1;
+    }
+    path[record->path_len] = '\0';
+    return 1;
+}
@@ -0,0 +1,90 @@
+#ifndef FAT32_TRACE_H
+#define FAT32_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// a trace is a trace_header_t followed by one trace_record_t per library call, each followed by
+// path_len bytes of path (not NUL terminated). Every integer is little endian
+
+#define TRACE_MAGIC "F32TRACE"
+#define TRACE_VERSION 1
+#define TRACE_PATH_MAX 0xFFFF
+
+#define TRACE_MKDIR 1
+#define TRACE_TOUCH 2
+// flags is 1 for a recursive rm
+#define TRACE_RM 3
+#define TRACE_RMDIR 4
+#define TRACE_STAT 5
+// offset and count are the arguments, result the number of bytes transferred
+#define TRACE_READ 6
+#define TRACE_WRITE 7
+// opendir to closedir, result is the number of entries read
+#define TRACE_LS 8
+#define TRACE_COMPACT 9
+#define TRACE_DEFRAG 10
+// count is the number of threads
+#define TRACE_DU 11
+#define TRACE_BEGIN_BATCH 12
+#define TRACE_END_BATCH 13
+// count is the number of threads
+#define TRACE_WALK 14
+#define TRACE_IS_DIRECTORY 15
+#define TRACE_EXISTS 16
+#define TRACE_TRIM 17
+// path is the checkpoint name
+#define TRACE_CHECKPOINT 18
+// path is the checkpoint name, flags is 1 when the checkpoint advances
+#define TRACE_DIFF 19
+#define TRACE_FLATTEN 20
+// count is the policy
+#define TRACE_SET_ALLOC_POLICY 21
+#define TRACE_OP_COUNT 22
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} __attribute__((packed)) trace_header_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t path_len;
+    uint32_t count;
+    uint64_t offset;
+    // nanoseconds since the recording started, and spent in the call
+    uint64_t start;
+    uint64_t duration;
+    int64_t result;
+} __attribute__((packed)) trace_record_t;
+
+typedef struct trace trace_t;
+
+// monotonic nanoseconds
+uint64_t trace_now(void);
+const char *trace_op_name(int op);
+
+// truncates path and starts a new recording
+trace_t *trace_create(const char *path);
+// returns the time to pass to trace_add, 0 when trace is NULL
+uint64_t trace_start(trace_t *trace);
+// records a call that began at start, a NULL trace records nothing
+void trace_add(trace_t *trace,
+               int op,
+               const char *path,
+               int flags,
+               uint64_t offset,
+               uint32_t count,
+               uint64_t start,
+               int64_t result);
+int trace_close(trace_t *trace);
+
+// opens a trace for reading and checks its header
+FILE *trace_open(const char *path);
+// path must hold TRACE_PATH_MAX + 1 bytes, returns 1 if a record was read, 0 at the end, -1 on
+// error
+int trace_read(FILE *file, trace_record_t *record, char *path);
+
+#endif
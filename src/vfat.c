@@ -0,0 +1,353 @@
+#include "vfat.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define VFAT_LAST_ENTRY 0x40
+#define VFAT_ORDINAL_MASK 0x3F
+#define VFAT_CHECKSUM_OFFSET 13
+
+// byte offsets of the 13 characters inside a long name entry
+static const uint8_t lfn_offsets[VFAT_CHARS_PER_ENTRY] = {
+    1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30,
+};
+
+static uint16_t fold(uint16_t c) {
+    return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+static int is_short_char(uint16_t c) {
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+        return 1;
+    return c < 0x80 && c != 0 && strchr("$%'-_@~`!(){}^#&", c) != NULL;
+}
+
+int vfat_decode(const char *name, size_t len, uint16_t *dest) {
+    const uint8_t *p = (const uint8_t *)name;
+    const uint8_t *end = p + len;
+    int count = 0;
+
+    while (p < end) {
+        uint32_t c = *p++;
+        int extra = 0;
+        if (c >= 0xE0 && c < 0xF0) {
+            c &= 0x0F;
+            extra = 2;
+        } else if (c >= 0xC2 && c < 0xE0) {
+            c &= 0x1F;
+            extra = 1;
+        } else if (c >= 0x80) {
+            // stray continuation bytes, overlong forms and anything outside the BMP
+            return -1;
+        }
+
+        for (; extra > 0; extra--) {
+            if (p == end || (*p & 0xC0) != 0x80)
+                return -1;
+            c = (c << 6) | (*p++ & 0x3F);
+        }
+
+        if (c < 0x20 || (c >= 0xD800 && c < 0xE000) || (c < 0x80 && strchr("\"*/:<>?\\|", c)))
+            return -1;
+        if (count == VFAT_NAME_MAX)
+            return -1;
+        dest[count++] = c;
+    }
+
+    if (count == 0)
+        return -1;
+
+    // only . and .. may end in a dot, and no name ends in a space
+    int dots = (count == 1 && dest[0] == '.') || (count == 2 && dest[0] == '.' && dest[1] == '.');
+    if (!dots && (dest[count - 1] == '.' || dest[count - 1] == ' '))
+        return -1;
+
+    return count;
+}
+
+size_t vfat_encode(const uint16_t *chars, uint32_t len, char *dest) {
+    size_t pos = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint16_t c = chars[i];
+        if (c < 0x80) {
+            dest[pos++] = c;
+        } else if (c < 0x800) {
+            dest[pos++] = 0xC0 | (c >> 6);
+            dest[pos++] = 0x80 | (c & 0x3F);
+        } else {
+            dest[pos++] = 0xE0 | (c >> 12);
+            dest[pos++] = 0x80 | ((c >> 6) & 0x3F);
+            dest[pos++] = 0x80 | (c & 0x3F);
+        }
+    }
+
+    dest[pos] = '\0';
+    return pos;
+}
+
+uint32_t vfat_hash(const uint16_t *chars, uint32_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint16_t c = fold(chars[i]);
+        hash = (hash ^ (c & 0xFF)) * 16777619u;
+        hash = (hash ^ (c >> 8)) * 16777619u;
+    }
+    return hash;
+}
+
+int vfat_equal(const uint16_t *a, uint32_t a_len, const uint16_t *b, uint32_t b_len) {
+    if (a_len != b_len)
+        return 0;
+
+    for (uint32_t i = 0; i < a_len; i++) {
+        if (fold(a[i]) != fold(b[i]))
+            return 0;
+    }
+    return 1;
+}
+
+uint8_t vfat_checksum(const uint8_t *name83) {
+    uint8_t sum = 0;
+
+    for (int i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + name83[i];
+    return sum;
+}
+
+void vfat_lfn_reset(vfat_lfn_t *lfn) {
+    lfn->count = 0;
+    lfn->next = 0;
+}
+
+void vfat_lfn_feed(vfat_lfn_t *lfn, const uint8_t *raw) {
+    uint8_t ord = raw[0];
+    uint8_t seq = ord & VFAT_ORDINAL_MASK;
+
+    if (ord & VFAT_LAST_ENTRY) {
+        if (seq == 0 || seq > VFAT_MAX_ENTRIES) {
+            vfat_lfn_reset(lfn);
+            return;
+        }
+        lfn->checksum = raw[VFAT_CHECKSUM_OFFSET];
+        lfn->len = seq * VFAT_CHARS_PER_ENTRY;
+        lfn->count = 0;
+    } else if (lfn->count == 0 || seq != lfn->next || raw[VFAT_CHECKSUM_OFFSET] != lfn->checksum) {
+        vfat_lfn_reset(lfn);
+        return;
+    }
+
+    uint32_t base = (seq - 1) * VFAT_CHARS_PER_ENTRY;
+    for (int i = 0; i < VFAT_CHARS_PER_ENTRY; i++) {
+        uint16_t c = raw[lfn_offsets[i]] | (raw[lfn_offsets[i] + 1] << 8);
+        // the last part carries the terminator, unless the name fills it exactly
+        if ((ord & VFAT_LAST_ENTRY) && c == 0 && base + i < lfn->len)
+            lfn->len = base + i;
+        lfn->chars[base + i] = c;
+    }
+
+    if (lfn->len == 0 || lfn->len > VFAT_NAME_MAX) {
+        vfat_lfn_reset(lfn);
+        return;
+    }
+
+    lfn->next = seq - 1;
+    lfn->count++;
+}
+
+int vfat_lfn_matches(const vfat_lfn_t *lfn, const uint8_t *raw) {
+    return lfn->count > 0 && lfn->next == 0 && lfn->checksum == vfat_checksum(raw);
+}
+
+uint32_t vfat_lfn_entries(uint32_t len) {
+    return (len + VFAT_CHARS_PER_ENTRY - 1) / VFAT_CHARS_PER_ENTRY;
+}
+
+void vfat_lfn_build(uint8_t *raw,
+                    const uint16_t *chars,
+                    uint32_t len,
+                    uint32_t ord,
+                    uint8_t checksum) {
+    memset(raw, 0, 32);
+    raw[0] = ord | (ord == vfat_lfn_entries(len) ? VFAT_LAST_ENTRY : 0);
+    raw[11] = VFAT_ATTR_LONG_NAME;
+    raw[VFAT_CHECKSUM_OFFSET] = checksum;
+
+    // the name is terminated by a zero and padded with 0xFFFF
+    uint32_t base = (ord - 1) * VFAT_CHARS_PER_ENTRY;
+    for (int i = 0; i < VFAT_CHARS_PER_ENTRY; i++) {
+        uint32_t idx = base + i;
+        uint16_t c = idx < len ? chars[idx] : idx == len ? 0 : 0xFFFF;
+        raw[lfn_offsets[i]] = c & 0xFF;
+        raw[lfn_offsets[i] + 1] = c >> 8;
+    }
+}
+
+int vfat_short_name(const uint16_t *chars,
+                    uint32_t len,
+                    uint8_t *name83,
+                    uint8_t *nt_res,
+                    int *mixed_case) {
+    if (len == 0 || len > 12)
+        return 0;
+
+    int dot = -1;
+    for (uint32_t i = 0; i < len; i++) {
+        if (chars[i] == '.') {
+            if (dot >= 0)
+                return 0;
+            dot = i;
+        }
+    }
+
+    uint32_t base_len = dot < 0 ? len : (uint32_t)dot;
+    uint32_t ext_len = dot < 0 ? 0 : len - dot - 1;
+    if (base_len == 0 || base_len > 8 || ext_len > 3 || (dot >= 0 && ext_len == 0))
+        return 0;
+
+    int lower[2] = {0, 0};
+    int upper[2] = {0, 0};
+    memset(name83, ' ', 11);
+
+    for (uint32_t i = 0; i < len; i++) {
+        if ((int)i == dot)
+            continue;
+
+        uint16_t c = chars[i];
+        if (!is_short_char(c))
+            return 0;
+
+        int part = dot >= 0 && (int)i > dot;
+        if (c >= 'a' && c <= 'z')
+            lower[part] = 1;
+        else if (c >= 'A' && c <= 'Z')
+            upper[part] = 1;
+
+        name83[part ? 8 + i - dot - 1 : i] = fold(c);
+    }
+
+    *nt_res = (lower[0] ? VFAT_LOWER_BASE : 0) | (lower[1] ? VFAT_LOWER_EXT : 0);
+    *mixed_case = (lower[0] && upper[0]) || (lower[1] && upper[1]);
+    return 1;
+}
+
+uint32_t vfat_short_chars(const uint8_t *name83, uint8_t nt_res, uint16_t *dest) {
+    uint32_t len = 0;
+
+    for (int i = 0; i < 8 && name83[i] != ' '; i++) {
+        uint16_t c = (i == 0 && name83[i] == 0x05) ? 0xE5 : name83[i];
+        if ((nt_res & VFAT_LOWER_BASE) && c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        dest[len++] = c;
+    }
+
+    if (name83[8] != ' ') {
+        dest[len++] = '.';
+        for (int i = 8; i < 11 && name83[i] != ' '; i++) {
+            uint16_t c = name83[i];
+            if ((nt_res & VFAT_LOWER_EXT) && c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            dest[len++] = c;
+        }
+    }
+
+    return len;
+}
+
+static uint8_t short_char(uint16_t c) {
+    c = fold(c);
+    return is_short_char(c) ? c : '_';
+}
+
+void vfat_basis(const uint16_t *chars, uint32_t len, uint8_t *basis) {
+    memset(basis, ' ', 11);
+
+    // leading dots and spaces are dropped, the extension follows the last dot
+    uint32_t start = 0;
+    while (start < len && (chars[start] == '.' || chars[start] == ' '))
+        start++;
+
+    uint32_t base_end = len;
+    for (uint32_t i = len; i > start; i--) {
+        if (chars[i - 1] == '.') {
+            base_end = i - 1;
+            break;
+        }
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = start; i < base_end && n < 8; i++) {
+        if (chars[i] != '.' && chars[i] != ' ')
+            basis[n++] = short_char(chars[i]);
+    }
+    if (n == 0)
+        basis[0] = '_';
+
+    n = 0;
+    for (uint32_t i = base_end + 1; i < len && n < 3; i++) {
+        if (chars[i] != ' ')
+            basis[8 + n++] = short_char(chars[i]);
+    }
+}
+
+static uint32_t basis_length(const uint8_t *basis) {
+    uint32_t len = 0;
+    while (len < 8 && basis[len] != ' ')
+        len++;
+    return len;
+}
+
+uint32_t vfat_alias_number(const uint8_t *basis, const uint8_t *name83) {
+    if (memcmp(basis + 8, name83 + 8, 3) != 0)
+        return 0;
+
+    int tilde = -1;
+    for (int i = 0; i < 8; i++) {
+        if (name83[i] == '~')
+            tilde = i;
+    }
+    if (tilde < 1 || tilde == 7 || name83[tilde + 1] == '0')
+        return 0;
+
+    uint32_t n = 0;
+    uint32_t digits = 0;
+    int i = tilde + 1;
+    for (; i < 8 && name83[i] != ' '; i++) {
+        if (name83[i] < '0' || name83[i] > '9')
+            return 0;
+        n = n * 10 + (name83[i] - '0');
+        digits++;
+    }
+    for (; i < 8; i++) {
+        if (name83[i] != ' ')
+            return 0;
+    }
+
+    // the alias keeps as much of the basis as fits in front of its tail
+    uint32_t keep = basis_length(basis);
+    if (keep > 7 - digits)
+        keep = 7 - digits;
+    if ((uint32_t)tilde != keep || memcmp(name83, basis, keep) != 0)
+        return 0;
+
+    return n;
+}
+
+int vfat_alias(const uint8_t *basis, uint32_t n, uint8_t *name83) {
+    char tail[16];
+    int tail_len = snprintf(tail, sizeof(tail), "~%u", n);
+    if (n == 0 || tail_len > 7)
+        return -1;
+
+    uint32_t keep = basis_length(basis);
+    if (keep > 8 - (uint32_t)tail_len)
+        keep = 8 - tail_len;
+
+    memset(name83, ' ', 8);
+    memcpy(name83, basis, keep);
+    memcpy(name83 + keep, tail, tail_len);
+    memcpy(name83 + 8, basis + 8, 3);
+    return 0;
+}
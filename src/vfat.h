@@ -0,0 +1,66 @@
+#ifndef FAT32_VFAT_H
+#define FAT32_VFAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// long names are up to 255 UCS-2 characters, stored 13 to an entry in front of the short entry
+#define VFAT_NAME_MAX 255
+#define VFAT_CHARS_PER_ENTRY 13
+#define VFAT_MAX_ENTRIES 20
+#define VFAT_ATTR_LONG_NAME 0x0F
+// nt_res bits of a short name whose base or extension is all lowercase
+#define VFAT_LOWER_BASE 0x08
+#define VFAT_LOWER_EXT 0x10
+
+// long name collected from the entries in front of a short entry. Entries come last part first,
+// every part goes straight to its place, so nothing is reassembled once the short entry is reached
+typedef struct {
+    uint16_t chars[VFAT_MAX_ENTRIES * VFAT_CHARS_PER_ENTRY];
+    uint32_t len;
+    uint8_t checksum;
+    // ordinal of the entry expected next, 0 once the sequence is complete
+    uint8_t next;
+    // entries collected, 0 when no sequence is in progress
+    uint8_t count;
+} vfat_lfn_t;
+
+// UTF-8 to UCS-2, returns the number of characters or -1 if the name cannot be stored
+int vfat_decode(const char *name, size_t len, uint16_t *dest);
+// UCS-2 to NUL terminated UTF-8, dest needs room for three bytes per character
+size_t vfat_encode(const uint16_t *chars, uint32_t len, char *dest);
+// case-insensitive, the same way names are compared
+uint32_t vfat_hash(const uint16_t *chars, uint32_t len);
+int vfat_equal(const uint16_t *a, uint32_t a_len, const uint16_t *b, uint32_t b_len);
+
+uint8_t vfat_checksum(const uint8_t *name83);
+void vfat_lfn_reset(vfat_lfn_t *lfn);
+// takes one long name entry, anything out of sequence starts over
+void vfat_lfn_feed(vfat_lfn_t *lfn, const uint8_t *raw);
+// whether the collected name belongs to the short entry raw
+int vfat_lfn_matches(const vfat_lfn_t *lfn, const uint8_t *raw);
+uint32_t vfat_lfn_entries(uint32_t len);
+// fills the long name entry with ordinal ord, 1 being the first part of the name
+void vfat_lfn_build(uint8_t *raw,
+                    const uint16_t *chars,
+                    uint32_t len,
+                    uint32_t ord,
+                    uint8_t checksum);
+
+// returns 1 if the name is a valid 8.3 name, filling its uppercase short form. It needs no long
+// name entries unless mixed_case is set, otherwise nt_res gets its case bits
+int vfat_short_name(const uint16_t *chars,
+                    uint32_t len,
+                    uint8_t *name83,
+                    uint8_t *nt_res,
+                    int *mixed_case);
+// the short name as it is shown and matched
+uint32_t vfat_short_chars(const uint8_t *name83, uint8_t nt_res, uint16_t *dest);
+// the short name a long name is abbreviated to before a ~N tail is added
+void vfat_basis(const uint16_t *chars, uint32_t len, uint8_t *basis);
+// returns N if name83 is basis with a ~N tail, 0 otherwise
+uint32_t vfat_alias_number(const uint8_t *basis, const uint8_t *name83);
+// returns -1 if N has more than six digits
+int vfat_alias(const uint8_t *basis, uint32_t n, uint8_t *name83);
+
+#endif